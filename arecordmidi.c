@@ -21,25 +21,153 @@
 
 /* TODO: sequencer queue timer selection */
 
+#define _GNU_SOURCE	/* fallocate() */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <getopt.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <alsa/asoundlib.h>
 #include "version.h"
+#include "smf.h"
+#include "catalog.h"
+#include "migrate.h"
+#include "retention.h"
+#include "control.h"
+#include "pack.h"
+#include "budget.h"
+#ifdef HAVE_ZSTD
+#include "zseek.h"
+#endif
 #include <stdbool.h>
+#include <time.h>
+#include <math.h>
+
+/* the sequencer delivers MIDI 2.0 (UMP) events since alsa-lib 1.2.10 */
+#if SND_LIB_VERSION >= 0x01020a && !defined(SMALL_FOOTPRINT)
+#define HAVE_UMP 1
+#endif
+/* and raw MIDI bytes with the time the kernel received them since 1.2.6 */
+#if SND_LIB_VERSION >= 0x010206
+#define HAVE_RAWMIDI_TSTAMP 1
+#endif
+
+/*
+ * Static tracepoints for bpftrace/systemtap (see tracing/).  Without
+ * <sys/sdt.h> they compile to nothing; with it, each probe is a single
+ * nop until a tracer attaches, and the timing arguments are only
+ * measured while the probe's semaphore says someone is listening.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short arecordmidi_##name##_semaphore \
+	__attribute__((unused)) __attribute__((section(".probes")))
+#define PROBE_ENABLED(name) \
+	__builtin_expect(arecordmidi_##name##_semaphore != 0, 0)
+#define PROBE2(name, a, b) DTRACE_PROBE2(arecordmidi, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(arecordmidi, name, a, b, c)
+PROBE_SEMAPHORE(record_event);
+PROBE_SEMAPHORE(output_event);
+PROBE_SEMAPHORE(flush_buffer);
+PROBE_SEMAPHORE(update_length);
+PROBE_SEMAPHORE(write_track_end);
+PROBE_SEMAPHORE(flush_control);
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) \
+	do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+/*
+ * -DCHECK_ALLOC builds check that recording never allocates memory:
+ * once the capture loop runs, malloc(), calloc() or realloc() on its
+ * thread aborts, except while a take is started or finished.  The abort
+ * finishes the take like any crash, and its core shows who allocated.
+ * The finisher, migration and retention threads are not checked.
+ */
+#ifdef CHECK_ALLOC
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static __thread int alloc_forbidden;
+
+static void check_alloc(void)
+{
+	static const char msg[] = "Memory allocated while recording\n";
+
+	if (alloc_forbidden > 0) {
+		alloc_forbidden = 0;
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		abort();
+	}
+}
+
+void *malloc(size_t size)
+{
+	check_alloc();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	check_alloc();
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	check_alloc();
+	return __libc_realloc(p, size);
+}
+
+#define ALLOC_FORBID() (alloc_forbidden++)
+#define ALLOC_ALLOW() (alloc_forbidden--)
+#else
+#define ALLOC_FORBID() do { } while (0)
+#define ALLOC_ALLOW() do { } while (0)
+#endif
+
+#define MAX_DELTA 0x0fffffff	/* the largest four-byte variable-length value */
+#define TRACK_SIZE_MAX 0xfc000000u	/* the MTrk length has 32 bits */
+#define UMP_DELTA_MAX 0xfffff	/* the largest Delta Clockstamp, 20 bits */
+#define TRACK_END_MAX 20	/* bytes in the longest end of track or clip */
+#define EVENT_MARKER SND_SEQ_EVENT_USR_VAR0	/* a --control mark, its label as data */
 
-#define EVENT_QUEUE_SIZE 128
+/*
+ * The switches of the subsystems that a small-footprint build leaves out
+ * are constants there, so that the code behind them is dropped.
+ */
+#ifdef SMALL_FOOTPRINT
+#define OPTIONAL const
+#else
+#define OPTIONAL
+#endif
 
 struct smf_track {
-	int size;			/* size of entire data */
-	snd_seq_tick_time_t last_tick;	/* end of track */
+	unsigned int size;		/* size of entire data */
+	uint64_t last_tick;		/* end of track; the queue tick wraps */
 	unsigned char last_command;	/* used for running status */
 	
-	struct snd_seq_event event_queue[EVENT_QUEUE_SIZE];
+	struct snd_seq_event event_queue[QUEUE_MAX];
 	int event_queue_size;
 };
 
@@ -48,6 +176,8 @@ static int client;
 static bool got_a_port;
 static snd_seq_addr_t port;
 static int queue;
+static unsigned int queue_tempo;	/* effective queue tempo (us per quarter) */
+static int queue_ppq;			/* and resolution, for tick <-> time */
 static int smpte_timing = 0;
 static int beats = 120;
 static int frames;
@@ -55,16 +185,168 @@ static int ticks = 0;
 static int timeout = 0;
 static FILE *file;
 static long size_offset;
+static long track_offset;	/* where the track data starts */
+static OPTIONAL bool ump;	/* MIDI 2.0 events into a MIDI Clip File */
+static int queue_size = EVENT_QUEUE_SIZE;	/* events per flush */
+/* --max-risk and --max-flush-rate: the flush threshold follows the input */
+static bool adaptive;
+static int max_risk;		/* ms an event may wait to be written */
+static double max_flush_rate;	/* flushes per second */
+static struct flow {
+	int flush_at;		/* events since the last flush that make one */
+	int arrived;		/* since the last flush */
+	snd_seq_tick_time_t deadline;	/* those must be written by then */
+	snd_seq_tick_time_t last_flush;
+	double rate;		/* events per second, smoothed */
+	double write_us;	/* time a flush takes, decaying peak */
+} flow;
+static const char *output;	/* file name, or a strftime() pattern */
+static bool rotate;		/* output is a pattern: a take per -T pause or --control rotate */
+static const char *OPTIONAL staging;
+static char take_path[PATH_MAX];	/* where the current take is written */
+static char dest_path[PATH_MAX];	/* and where it ends up */
+static bool take_open;
+static const char *control;	/* --control: the socket commands come from */
+static bool recording;		/* with --control: started, not stopped */
+static OPTIONAL bool seek_index;
+static OPTIONAL bool columns;	/* --columns */
+static OPTIONAL bool note_index;	/* --notes */
+static bool verify_failed;
+static OPTIONAL bool retain;	/* --quota or --max-age */
+static const char *replay;	/* SMF to read events from instead of a port */
+static double replay_speed;	/* virtual time per real time, 0: no waiting */
+static unsigned long replay_duration;	/* s of virtual time, 0: one pass */
+static snd_seq_tick_time_t replay_tick;	/* the virtual queue time */
+static const char *rawmidi_device;	/* --rawmidi: bytes instead of a port */
+#ifdef HAVE_RAWMIDI_TSTAMP
+static snd_rawmidi_t *rawmidi;
+#endif
+static unsigned long long rawmidi_origin;	/* ns of the monotonic clock at tick 0 */
+#ifdef HAVE_ZSTD
+static bool compress;
+static int zstd_level;
+static struct zseek_writer zseek;
+#endif
+#ifdef SMALL_FOOTPRINT
+static unsigned char block[BLOCK_SIZE];	/* encoded data not yet written */
+static int block_len, block_size = BLOCK_SIZE;
+#else
+static unsigned char *block;	/* encoded data not yet written */
+static int block_len, block_size;
+#endif
+/* two, so that the events held back for reordering keep their data */
+#ifdef SMALL_FOOTPRINT
+static unsigned char sysex_arenas[2][SYSEX_ARENA_SIZE];
+static unsigned char *sysex_arena = sysex_arenas[0];
+static const unsigned int sysex_arena_size = SYSEX_ARENA_SIZE;
+#else
+static unsigned char *sysex_arenas[2];	/* allocated by size_buffers() */
+static unsigned char *sysex_arena;
+static unsigned int sysex_arena_size = SYSEX_ARENA_SIZE;
+#endif
+static unsigned int sysex_len;
+/* --latency: the input latency of each source, taken off its ticks */
+static struct {
+	snd_seq_addr_t source;
+	double us;
+	int ticks;		/* once the queue tempo is known */
+} latency[LATENCY_MAX];
+static int latency_count;
+static int latency_hold;	/* ticks an event may be overtaken by */
+static snd_seq_addr_t loopback;	/* --self-test through a cable from here */
+static bool got_loopback;
+static long reserved;		/* disk space is allocated up to here */
+static bool disk_full;		/* blocks are kept in memory meanwhile */
+static unsigned long lost_events;	/* dropped when that memory ran out */
+static unsigned char last_end[TRACK_END_MAX];	/* the end of track in the file */
+static int last_end_len;
+static int file_fd = -1;	/* of the open take, for emergency_finish() */
+static volatile sig_atomic_t encoding;	/* flush_buffer() is encoding */
+static int encode_end;		/* the events it encodes */
+static volatile sig_atomic_t encoded;	/* queued events already in the block */
+/* hold_back() is moving the events from..size to the front */
+static volatile sig_atomic_t holding;
+static volatile struct {
+	sig_atomic_t from, size, moved;
+} held;
+static volatile sig_atomic_t emergency;	/* emergency_finish() has run */
+static bool block_full;		/* the block could not grow in an emergency */
+/* the encoder state after the last complete event */
+static struct {
+	unsigned int size;
+	int block_len, events;
+	uint64_t last_tick;
+	snd_seq_tick_time_t t_start;
+	unsigned char last_command;
+} committed;
 static struct smf_track track = { };
 static volatile sig_atomic_t stop = 0;
 static int ts_num = 4; /* time signature: numerator */
 static int ts_div = 4; /* time signature: denominator */
 static int ts_dd = 2; /* time signature: denominator as a power of two */
 static snd_seq_tick_time_t t_start = 0;
+static OPTIONAL bool verify;
+static bool summary;
+static const char *OPTIONAL catalog;
+static FILE *seek_file;
+static FILE *cols_file;
+/* the rows of the next --columns row group, one per message */
+static struct {
+	uint64_t *tick;
+	unsigned char *type, *channel, *data1, *data2;
+	uint32_t *payload, *length;
+	int rows, size;
+} cols;
+static FILE *notes_file;
+/* the notes sounding, by channel and key, for --notes; velocity 0: none */
+static struct {
+	uint64_t start;
+	unsigned char velocity;
+} open_notes[16][128];
+static struct smf_note *notes;	/* ended since the last flush */
+static int notes_count, notes_size;
+static struct smf_state seek_state;	/* channel state for the seek index */
+static unsigned int seek_size;		/* track size at the last seek point */
+static uint64_t end_tick;		/* of the last track end written */
+static unsigned long long start_time;	/* of the queue, us since the epoch */
+
+/* for --summary: statistics accumulated as events are encoded */
+static struct take_stats {
+	unsigned long messages;
+	unsigned long notes;
+	unsigned int channels;		/* bit mask */
+	unsigned long pitches[128];
+	unsigned long velocities[128];
+} stats;
 
+/* for --summary: what the flush controller did */
+static struct flush_stats {
+	unsigned long flushes;
+	unsigned long at_deadline;	/* flushed by --max-risk */
+	unsigned long capped;		/* --max-flush-rate was out of reach */
+	int min_at, max_at;
+	double write_max_us;
+} flush_stats;
+
+/*
+ * For --verify: a hash of the messages the file should decode to,
+ * computed from the sequencer events rather than from the bytes the
+ * encoder produced.
+ */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static struct expected {
+	uint64_t hash;
+	unsigned long messages;
+	uint64_t tick;
+} expected = { .hash = FNV_OFFSET };
+
+
+static bool emergency_finish(void);
 
 /* prints an error message to stderr, and dies */
-static void fatal(const char *msg, ...)
+static void __attribute__((noreturn)) fatal(const char *msg, ...)
 {
 	va_list ap;
 
@@ -72,6 +354,9 @@ static void fatal(const char *msg, ...)
 	vfprintf(stderr, msg, ap);
 	va_end(ap);
 	fputc('\n', stderr);
+	/* no exit(): stdio would write its buffers over the finished take */
+	if (emergency_finish())
+		_exit(EXIT_FAILURE);
 	exit(EXIT_FAILURE);
 }
 
@@ -82,10 +367,32 @@ static void check_snd(const char *operation, int err)
 		fatal("Cannot %s - %s", operation, snd_strerror(err));
 }
 
+/* monotonic clock in nanoseconds, for tracepoint latencies */
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* wall clock in microseconds since the epoch */
+static unsigned long long realtime_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 static void init_seq(void)
 {
 	int err;
 
+	/* on first use: --replay needs no sequencer */
+	if (seq)
+		return;
+
 	/* open sequencer */
 	err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
 	check_snd("open sequencer", err);
@@ -111,6 +418,7 @@ static void parse_port(const char *arg)
 		fatal("Only 1 port allowed (this differs from standard ALSA arecordmidi)");
 	}
 	
+	init_seq();
 	err = snd_seq_parse_address(seq, &port, port_name);
 	if (err < 0)
 		fatal("Invalid port %s - %s", port_name, snd_strerror(err));
@@ -136,15 +444,87 @@ static void time_signature(const char *arg)
 		++ts_dd;
 }
 
-static void create_queue(void)
+#ifndef SMALL_FOOTPRINT
+/* parses a size such as 500M or 20G */
+static uint64_t parse_size(const char *arg)
 {
-	snd_seq_queue_tempo_t *tempo;
+	char *end;
+	double x = strtod(arg, &end);
+	const char *units = "KMGT", *unit = *end ? strchr(units, *end) : NULL;
+
+	if (x <= 0 || (*end && (!unit || end[1])))
+		fatal("Invalid size (%s)", arg);
+	if (unit)
+		x *= 1ULL << (10 * (unit - units + 1));
+	return x;
+}
+#endif
+
+/* parses an age such as 30d, 12h or 90m */
+static unsigned long parse_age(const char *arg)
+{
+	char *end;
+	long x = strtol(arg, &end, 10);
+
+	if (x <= 0 || (strcmp(end, "d") && strcmp(end, "h") && strcmp(end, "m")))
+		fatal("Invalid age (%s)", arg);
+	return x * (*end == 'd' ? 86400 : *end == 'h' ? 3600 : 60);
+}
+
+/* adds a --latency entry: a port and its latency in milliseconds */
+static void add_latency(const char *name, const char *ms)
+{
+	char *end;
+	double x = strtod(ms, &end);
 	int err;
 
-	queue = snd_seq_alloc_named_queue(seq, "arecordmidi");
-	check_snd("create queue", queue);
+	if (end == ms || *end || fabs(x) > 1000)
+		fatal("Invalid latency %s for %s", ms, name);
+	if (latency_count == LATENCY_MAX)
+		fatal("Too many latencies, at most %d", LATENCY_MAX);
+	init_seq();
+	err = snd_seq_parse_address(seq, &latency[latency_count].source, name);
+	if (err < 0)
+		fatal("Invalid port %s - %s", name, snd_strerror(err));
+	latency[latency_count++].us = x * 1000;
+}
 
-	snd_seq_queue_tempo_alloca(&tempo);
+/*
+ * Parses port=ms[,port=ms...], or the name of a file with a "port ms"
+ * line per source, such as the lines --self-test --loopback prints.
+ */
+static void parse_latency(const char *arg)
+{
+	char line[256], name[128], ms[32], *entry, *save;
+
+	if (strchr(arg, '=')) {
+		snprintf(line, sizeof(line), "%s", arg);
+		for (entry = strtok_r(line, ",", &save); entry;
+		     entry = strtok_r(NULL, ",", &save)) {
+			char *sep = strrchr(entry, '=');
+
+			if (!sep)
+				fatal("Invalid latency %s", entry);
+			*sep = 0;
+			add_latency(entry, sep + 1);
+		}
+	} else {
+		FILE *f = fopen(arg, "r");
+
+		if (!f)
+			fatal("Cannot open %s - %s", arg, strerror(errno));
+		while (fgets(line, sizeof(line), f)) {
+			if (*line == '#' || sscanf(line, "%127s %31s", name, ms) != 2)
+				continue;
+			add_latency(name, ms);
+		}
+		fclose(f);
+	}
+}
+
+/* the queue tempo and resolution for the -b/-f/-t options */
+static void set_timing(snd_seq_queue_tempo_t *tempo)
+{
 	if (!smpte_timing) {
 		snd_seq_queue_tempo_set_tempo(tempo, 60000000 / beats);
 		snd_seq_queue_tempo_set_ppq(tempo, ticks);
@@ -175,11 +555,66 @@ static void create_queue(void)
 			fatal("Invalid SMPTE frames %d", frames);
 		}
 	}
+}
+
+static void create_queue(void)
+{
+	snd_seq_queue_tempo_t *tempo;
+	int err;
+
+	queue = snd_seq_alloc_named_queue(seq, "arecordmidi");
+	check_snd("create queue", queue);
+
+	snd_seq_queue_tempo_alloca(&tempo);
+	set_timing(tempo);
 	err = snd_seq_set_queue_tempo(seq, queue, tempo);
 	if (err < 0)
 		fatal("Cannot set queue tempo (%u/%i)",
 		      snd_seq_queue_tempo_get_tempo(tempo),
 		      snd_seq_queue_tempo_get_ppq(tempo));
+	queue_tempo = snd_seq_queue_tempo_get_tempo(tempo);
+	queue_ppq = snd_seq_queue_tempo_get_ppq(tempo);
+}
+
+/* converts a number of queue ticks to microseconds */
+static double ticks_to_us(double t)
+{
+	return t * queue_tempo / queue_ppq;
+}
+
+static double us_to_ticks(double us)
+{
+	return us * queue_ppq / queue_tempo;
+}
+
+/* with --rawmidi, the queue time of a monotonic clock time; it wraps */
+static snd_seq_tick_time_t rawmidi_tick(unsigned long long ns)
+{
+	return (uint64_t)us_to_ticks((ns - rawmidi_origin) / 1000.0);
+}
+
+/*
+ * Converts the latencies to ticks.  An event can be overtaken by one
+ * received later from a source with a larger latency, or with none, so
+ * events are held back until that latency has passed.
+ */
+static void set_latency_ticks(void)
+{
+	latency_hold = 0;
+	for (int i = 0; i < latency_count; i++) {
+		latency[i].ticks = lround(us_to_ticks(latency[i].us));
+		if (latency[i].ticks > latency_hold)
+			latency_hold = latency[i].ticks;
+	}
+}
+
+static int source_latency(const snd_seq_addr_t *source)
+{
+	for (int i = 0; i < latency_count; i++)
+		if (latency[i].source.client == source->client &&
+		    latency[i].source.port == source->port)
+			return latency[i].ticks;
+	return 0;
 }
 
 static void create_port(void)
@@ -228,15 +663,29 @@ static void connect_port(void)
 /* records a byte to be written to the .mid file */
 static void add_byte(struct smf_track *track, unsigned char byte)
 {
-	fputc(byte, file);
+	if (block_len == block_size) {
+#ifdef SMALL_FOOTPRINT
+		/* BLOCK_SIZE has room for a queue on top of SPILL_MAX */
+		block_full = true;
+		return;
+#else
+		if (emergency) {
+			block_full = true;
+			return;
+		}
+		block_size = block_size ? block_size * 2 : 65536;
+		block = realloc(block, block_size);
+		if (!block)
+			fatal("Out of memory");
+#endif
+	}
+	block[block_len++] = byte;
 	track->size++;
 }
 
-/* record a variable-length quantity */
+/* record a variable-length quantity, 'v' is at most MAX_DELTA */
 static void var_value(struct smf_track *track, int v)
 {
-	if (v >= (1 << 28))
-		add_byte(track, 0x80 | ((v >> 28) & 0x03));
 	if (v >= (1 << 21))
 		add_byte(track, 0x80 | ((v >> 21) & 0x7f));
 	if (v >= (1 << 14))
@@ -250,11 +699,23 @@ static void var_value(struct smf_track *track, int v)
 static void delta_time(struct smf_track *track, const snd_seq_event_t *ev)
 {
 	snd_seq_tick_time_t tick = ev->time.tick - t_start;
-	int diff = tick - track->last_tick;
+	/* the difference is right across a wrap of the 32-bit queue tick */
+	int diff = tick - (snd_seq_tick_time_t)track->last_tick;
 	if (diff < 0)
 		diff = 0;
+	/* a longer pause than a delta time can hold goes into empty text events */
+	while (diff > MAX_DELTA) {
+		var_value(track, MAX_DELTA);
+		add_byte(track, 0xff);
+		add_byte(track, 0x01);
+		add_byte(track, 0);
+		track->last_command = 0;	/* no running status after a meta event */
+		track->last_tick += MAX_DELTA;
+		diff -= MAX_DELTA;
+	}
 	var_value(track, diff);
-	track->last_tick = tick;
+	/* an event out of order must not move the time base backwards */
+	track->last_tick += diff;
 }
 
 /* record a status byte (or not if we can use running status) */
@@ -265,8 +726,69 @@ static void command(struct smf_track *track, unsigned char cmd)
 	track->last_command = cmd < 0xf0 ? cmd : 0;
 }
 
-static void output_event(struct smf_track *track, const snd_seq_event_t *ev)
+/*
+ * With --ump, the queued events carry their UMP words as variable-length
+ * data, and are written to a MIDI Clip File: each message as it came,
+ * preceded by a Delta Clockstamp, all in big-endian 32-bit words.
+ */
+static void add_word(struct smf_track *track, uint32_t word)
+{
+	add_byte(track, word >> 24);
+	add_byte(track, word >> 16);
+	add_byte(track, word >> 8);
+	add_byte(track, word);
+}
+
+/* the size of a UMP in 32-bit words, from its message type */
+static int ump_words(uint32_t word)
+{
+	static const unsigned char words[16] = {
+		1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4
+	};
+
+	return words[word >> 28];
+}
+
+/* a Delta Clockstamp, the clip's delta time */
+static uint32_t ump_delta(int ticks)
+{
+	return 0x00400000 | ticks;
+}
+
+static void ump_delta_time(struct smf_track *track, const snd_seq_event_t *ev)
+{
+	snd_seq_tick_time_t tick = ev->time.tick - t_start;
+	int diff = tick - (snd_seq_tick_time_t)track->last_tick;
+	if (diff < 0)
+		diff = 0;
+	/* a longer pause goes into NOOPs, each with its own clockstamp */
+	while (diff > UMP_DELTA_MAX) {
+		add_word(track, ump_delta(UMP_DELTA_MAX));
+		add_word(track, 0);
+		track->last_tick += UMP_DELTA_MAX;
+		diff -= UMP_DELTA_MAX;
+	}
+	add_word(track, ump_delta(diff));
+	track->last_tick += diff;
+}
+
+static void encode_ump(struct smf_track *track, const snd_seq_event_t *ev)
 {
+	const uint32_t *words = ev->data.ext.ptr;
+	int type = words[0] >> 28;
+
+	/* timestamps and stream messages would clash with the clip's own */
+	if (type == 0x0 || type == 0xf)
+		return;
+	ump_delta_time(track, ev);
+	for (int i = 0; i < ump_words(words[0]); i++)
+		add_word(track, words[i]);
+}
+
+static void encode_event(struct smf_track *track, const snd_seq_event_t *ev)
+{
+	unsigned int i;
+
 	/* ignore events without proper timestamps */
 	if (ev->queue != queue || !snd_seq_ev_is_tick(ev))
 		return;
@@ -278,6 +800,11 @@ static void output_event(struct smf_track *track, const snd_seq_event_t *ev)
 	// Our one port and one track
 	if (ev->dest.port != 0)
 		return;
+
+	if (ump) {
+		encode_ump(track, ev);
+		return;
+	}
 	
 	switch (ev->type) {
 	case SND_SEQ_EVENT_NOTEON:
@@ -375,16 +902,29 @@ static void output_event(struct smf_track *track, const snd_seq_event_t *ev)
 	case SND_SEQ_EVENT_SENSING:
 		break;
 #endif
+	case EVENT_MARKER:
+		delta_time(track, ev);
+		add_byte(track, 0xff);
+		add_byte(track, 0x06);
+		var_value(track, ev->data.ext.len);
+		for (i = 0; i < ev->data.ext.len; ++i)
+			add_byte(track, ((unsigned char*)ev->data.ext.ptr)[i]);
+		track->last_command = 0;	/* no running status after a meta event */
+		break;
 	case SND_SEQ_EVENT_SYSEX:
 		if (ev->data.ext.len == 0)
 			break;
 		delta_time(track, ev);
-		if (*(unsigned char*)ev->data.ext.ptr == 0xf0)
+		/* the F0 status byte is not repeated in the data */
+		if (*(unsigned char*)ev->data.ext.ptr == 0xf0) {
 			command(track, 0xf0);
-		else
+			i = 1;
+		} else {
 			command(track, 0xf7);
-		var_value(track, ev->data.ext.len);
-		for (int i = 0; i < ev->data.ext.len; ++i)
+			i = 0;
+		}
+		var_value(track, ev->data.ext.len - i);
+		for (; i < ev->data.ext.len; ++i)
 			add_byte(track, ((unsigned char*)ev->data.ext.ptr)[i]);
 		break;
 	default:
@@ -392,163 +932,2221 @@ static void output_event(struct smf_track *track, const snd_seq_event_t *ev)
 	}
 }
 
-static void write_header(void)
+static uint64_t fnv1a(uint64_t hash, const unsigned char *data, size_t len)
 {
-	int time_division;
+	while (len--)
+		hash = (hash ^ *data++) * FNV_PRIME;
+	return hash;
+}
 
-	/* header id and length */
-	fwrite("MThd\0\0\0\6", 1, 8, file);
-	/* type 0 or 1 */
-	fputc(0, file);
-	fputc(false, file);
-	/* number of tracks */
-	fputc((1 >> 8) & 0xff, file);
-	fputc(1 & 0xff, file);
-	/* time division */
-	time_division = ticks;
-	if (smpte_timing)
-		time_division |= (0x100 - frames) << 8;
-	fputc(time_division >> 8, file);
-	fputc(time_division & 0xff, file);
+/* adds one MIDI message, in a canonical form, to a --verify hash */
+static uint64_t hash_message(uint64_t hash, uint64_t tick, unsigned char status,
+			     const unsigned char *data, uint32_t len)
+{
+	unsigned char head[13];
 
-	/* track id */
-	fwrite("MTrk", 1, 4, file);
-	
-	/* data length */
-	
-	// Record where the length is stored, so we can update it
-	// when data is added to the file.
-	size_offset = ftell(file);
-	
-	fputc((track.size >> 24) & 0xff, file);
-	fputc((track.size >> 16) & 0xff, file);
-	fputc((track.size >> 8) & 0xff, file);
-	fputc(track.size & 0xff, file);
+	for (int i = 0; i < 8; i++)
+		head[i] = tick >> (8 * i);
+	head[8] = status;
+	for (int i = 0; i < 4; i++)
+		head[9 + i] = len >> (8 * i);
+	hash = fnv1a(hash, head, sizeof(head));
+	return fnv1a(hash, data, len);
 }
 
-/* record a variable-length quantity directly to file */
-static int var_value_direct(int v)
+/* adds a message to the row group; there is room for a flush's worth */
+static void add_row(unsigned char status, unsigned char d1, unsigned char d2,
+		    uint32_t payload, uint32_t length)
 {
-	int extra_size = 0;
-	
-	if (v >= (1 << 28)) {
-		fputc(0x80 | ((v >> 28) & 0x03), file);
-		extra_size += 1;
-	}
-	if (v >= (1 << 21)) {
-		fputc(0x80 | ((v >> 21) & 0x7f), file);
-		extra_size += 1;
-	}
-	if (v >= (1 << 14)) {
-		fputc(0x80 | ((v >> 14) & 0x7f), file);
-		extra_size += 1;
-	}
-	if (v >= (1 << 7)) {
-		fputc(0x80 | ((v >> 7) & 0x7f), file);
-		extra_size += 1;
-	}
-	fputc(v & 0x7f, file);
-	extra_size += 1;
-	return extra_size;
+	int row = cols.rows++;
+
+	cols.tick[row] = expected.tick;
+	cols.type[row] = status < 0xf0 ? status & 0xf0 : status;
+	cols.channel[row] = status < 0xf0 ? status & 0x0f : 0;
+	cols.data1[row] = d1;
+	cols.data2[row] = d2;
+	cols.payload[row] = payload;
+	cols.length[row] = length;
 }
 
-static void flush_buffer(void)
+/* writes the rows of a flush as a row group, with their ranges */
+static void write_row_group(void)
 {
-	for (int i=0; i<track.event_queue_size; i++) {
-		output_event(&track, &track.event_queue[i]);
+	static const unsigned char padding[8];
+	struct smf_cols_group group = { .rows = cols.rows };
+	const unsigned char *bytes[4] = {
+		cols.type, cols.channel, cols.data1, cols.data2
+	};
+	size_t n = cols.rows;
+	size_t pad = SMF_COLS_GROUP_SIZE(n) - sizeof(group) - n * SMF_COLS_ROW_SIZE;
+	bool ok;
+
+	if (!n)
+		return;
+	/* the ticks do not decrease */
+	group.min_tick = cols.tick[0];
+	group.max_tick = cols.tick[n - 1];
+	for (int c = 0; c < 4; c++) {
+		group.min[c] = group.max[c] = bytes[c][0];
+		for (size_t i = 1; i < n; i++) {
+			if (bytes[c][i] < group.min[c])
+				group.min[c] = bytes[c][i];
+			if (bytes[c][i] > group.max[c])
+				group.max[c] = bytes[c][i];
+		}
+	}
+	ok = fwrite(&group, sizeof(group), 1, cols_file) == 1 &&
+		fwrite(cols.tick, 8, n, cols_file) == n;
+	for (int c = 0; c < 4 && ok; c++)
+		ok = fwrite(bytes[c], 1, n, cols_file) == n;
+	ok = ok && fwrite(cols.payload, 4, n, cols_file) == n &&
+		fwrite(cols.length, 4, n, cols_file) == n &&
+		fwrite(padding, 1, pad, cols_file) == pad && !fflush(cols_file);
+	if (!ok) {
+		fprintf(stderr, "Cannot write columns - %s; they end here\n",
+			strerror(errno));
+		fclose(cols_file);
+		cols_file = NULL;
 	}
-	track.event_queue_size = 0;
+	cols.rows = 0;
 }
 
-static void update_length(int extra_size)
+/* ends a sounding note at 'end' */
+static void end_note(int channel, int key, uint64_t end,
+		     unsigned char off_velocity, unsigned char flags)
 {
-	// Save position
-	long saved_pos = ftell(file);
-	
-	// Jump back to where we recorded the length
-	fseek(file, size_offset, SEEK_SET);
-	
-	int size = track.size += extra_size;
-	
-	fputc((size >> 24) & 0xff, file);
-	fputc((size >> 16) & 0xff, file);
-	fputc((size >> 8) & 0xff, file);
-	fputc(size & 0xff, file);
-	
-	// Jump back to where we were
-	fseek(file, saved_pos, SEEK_SET);
+	struct smf_note *n = &notes[notes_count++];
+
+	n->start = open_notes[channel][key].start;
+	n->end = end;
+	n->key = key;
+	n->velocity = open_notes[channel][key].velocity;
+	n->off_velocity = off_velocity;
+	n->channel = channel;
+	n->flags = flags;
+	open_notes[channel][key].velocity = 0;
 }
 
-static int write_track_end(void)
+/* pairs note ons with what ends them */
+static void note_event(unsigned char status, unsigned char key,
+		       unsigned char velocity)
 {
-	snd_seq_queue_status_t *queue_status;
-	int tick, err;
-	int extra_size = 0;
-
-	snd_seq_queue_status_alloca(&queue_status);
-
-	err = snd_seq_get_queue_status(seq, queue, queue_status);
-	check_snd("get queue status", err);
-	tick = snd_seq_queue_status_get_tick_time(queue_status);
+	int ch = status & 0x0f;
+	bool on = (status & 0xf0) == 0x90 && velocity;
 
-	/* make length of first (and only) track the recording length */
-	extra_size += var_value_direct(tick - track.last_tick);
-	fputc(0xff, file);
-	fputc(0x2f, file);
-	extra_size += 2;
-	extra_size += var_value_direct(0);
-	
-	return extra_size;
+	if (open_notes[ch][key].velocity)
+		end_note(ch, key, expected.tick, on ? 0 : velocity, 0);
+	if (on) {
+		open_notes[ch][key].start = expected.tick;
+		open_notes[ch][key].velocity = velocity;
+	}
 }
 
-static int write_temporary_track_end(void)
+/*
+ * Writes the notes ended since the last flush, sorted by start.  They
+ * are nearly sorted already, and sorting in place does not allocate.
+ */
+static void write_notes(void)
 {
-	long saved_pos = ftell(file);
-	int extra_size = write_track_end();
-	fseek(file, saved_pos, SEEK_SET);
-	return extra_size;
-}
+	struct smf_notes_block block = { .count = notes_count };
 
-static void record_event(const snd_seq_event_t *ev)
-{
-	if (track.event_queue_size >= EVENT_QUEUE_SIZE) {
-		flush_buffer();
-		int extra_size = write_temporary_track_end();
-		update_length(extra_size);
+	if (!notes_count)
+		return;
+	for (int i = 1; i < notes_count; i++) {
+		struct smf_note n = notes[i];
+		int j = i;
+
+		while (j > 0 && notes[j - 1].start > n.start) {
+			notes[j] = notes[j - 1];
+			j--;
+		}
+		notes[j] = n;
 	}
-	
-	track.event_queue[track.event_queue_size++] = *ev;
+	block.min_start = notes[0].start;
+	block.max_end = notes[0].end;
+	for (int i = 1; i < notes_count; i++)
+		if (notes[i].end > block.max_end)
+			block.max_end = notes[i].end;
+	if (fwrite(&block, sizeof(block), 1, notes_file) != 1 ||
+	    fwrite(notes, sizeof(*notes), notes_count, notes_file) !=
+	    (size_t)notes_count || fflush(notes_file)) {
+		fprintf(stderr, "Cannot write note index - %s; it ends here\n",
+			strerror(errno));
+		fclose(notes_file);
+		notes_file = NULL;
+	}
+	notes_count = 0;
 }
 
-static void list_ports(void)
+/* one MIDI message of an encoded event, for --verify, --seek-index, --columns and --notes */
+static void message(unsigned char status, unsigned char d1, unsigned char d2)
 {
-	snd_seq_client_info_t *cinfo;
-	snd_seq_port_info_t *pinfo;
+	unsigned char data[2] = { d1 & 0x7f, d2 & 0x7f };
 
-	snd_seq_client_info_alloca(&cinfo);
-	snd_seq_port_info_alloca(&pinfo);
+	if (notes_file && (status & 0xe0) == 0x80)
+		note_event(status, data[0], data[1]);
 
-	puts(" Port    Client name                      Port name");
+	if (cols_file)
+		add_row(status, data[0],
+			smf_message_length(status) > 1 ? data[1] : 0, 0, 0);
 
-	snd_seq_client_info_set_client(cinfo, -1);
-	while (snd_seq_query_next_client(seq, cinfo) >= 0) {
-		int client = snd_seq_client_info_get_client(cinfo);
+	if (verify) {
+		expected.hash = hash_message(expected.hash, expected.tick, status,
+					     data, smf_message_length(status));
+		expected.messages++;
+	}
+	if (seek_file)
+		smf_state_apply(&seek_state, status, data);
+}
 
-		if (client == SND_SEQ_CLIENT_SYSTEM)
-			continue; /* don't show system timer and announce ports */
-		snd_seq_port_info_set_client(pinfo, client);
-		snd_seq_port_info_set_port(pinfo, -1);
-		while (snd_seq_query_next_port(seq, pinfo) >= 0) {
-			/* port must understand MIDI messages */
-			if (!(snd_seq_port_info_get_type(pinfo)
-			      & SND_SEQ_PORT_TYPE_MIDI_GENERIC))
-				continue;
-			/* we need both READ and SUBS_READ */
-			if ((snd_seq_port_info_get_capability(pinfo)
-			     & (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ))
-			    != (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ))
-				continue;
-			printf("%3d:%-3d  %-32.32s %s\n",
+/* splits an encoded event into the messages it must decode to */
+static void split_event(const snd_seq_event_t *ev)
+{
+	snd_seq_tick_time_t tick = ev->time.tick - t_start;
+	unsigned char ch = ev->data.control.channel & 0xf;
+	const unsigned char *sysex;
+	unsigned int skip;
+	int param = ev->data.control.param;
+	int value = ev->data.control.value;
+
+	if ((int)(tick - (snd_seq_tick_time_t)expected.tick) > 0)
+		expected.tick += (snd_seq_tick_time_t)(tick - expected.tick);
+
+	switch (ev->type) {
+	case SND_SEQ_EVENT_NOTEON:
+	case SND_SEQ_EVENT_NOTEOFF:
+	case SND_SEQ_EVENT_KEYPRESS:
+		message((ev->type == SND_SEQ_EVENT_NOTEON ? 0x90 :
+			 ev->type == SND_SEQ_EVENT_NOTEOFF ? 0x80 : 0xa0) |
+			(ev->data.note.channel & 0xf),
+			ev->data.note.note, ev->data.note.velocity);
+		break;
+	case SND_SEQ_EVENT_CONTROLLER:
+		message(0xb0 | ch, param, value);
+		break;
+	case SND_SEQ_EVENT_PGMCHANGE:
+		message(0xc0 | ch, value, 0);
+		break;
+	case SND_SEQ_EVENT_CHANPRESS:
+		message(0xd0 | ch, value, 0);
+		break;
+	case SND_SEQ_EVENT_PITCHBEND:
+		message(0xe0 | ch, value + 8192, (value + 8192) >> 7);
+		break;
+	case SND_SEQ_EVENT_CONTROL14:
+		message(0xb0 | ch, param, value >> 7);
+		if ((param & 0x7f) < 0x20)
+			message(0xb0 | ch, (param & 0x7f) + 0x20, value);
+		break;
+	case SND_SEQ_EVENT_NONREGPARAM:
+	case SND_SEQ_EVENT_REGPARAM:
+		message(0xb0 | ch, ev->type == SND_SEQ_EVENT_NONREGPARAM ?
+			0x62 : 0x64, param);
+		message(0xb0 | ch, ev->type == SND_SEQ_EVENT_NONREGPARAM ?
+			0x63 : 0x65, param >> 7);
+		message(0xb0 | ch, 0x06, value >> 7);
+		message(0xb0 | ch, 0x26, value);
+		break;
+	case SND_SEQ_EVENT_SYSEX:
+		sysex = ev->data.ext.ptr;
+		/* the F0 is the status byte, not data */
+		skip = sysex[0] == 0xf0;
+		if (verify) {
+			expected.hash = hash_message(expected.hash, expected.tick,
+						     skip ? 0xf0 : 0xf7, sysex + skip,
+						     ev->data.ext.len - skip);
+			expected.messages++;
+		}
+		/* the data was just encoded: it ends the track */
+		if (cols_file)
+			add_row(skip ? 0xf0 : 0xf7, 0, 0,
+				track.size - (ev->data.ext.len - skip),
+				ev->data.ext.len - skip);
+		break;
+	}
+}
+
+/* the --summary statistics from MIDI 1.0 and MIDI 2.0 channel voice messages */
+static void count_ump(const snd_seq_event_t *ev)
+{
+	const uint32_t *words = ev->data.ext.ptr;
+	int type = words[0] >> 28, note = (words[0] >> 8) & 0x7f;
+	int velocity = type == 2 ? words[0] & 0x7f : words[1] >> 25;
+
+	if (type != 2 && type != 4)
+		return;
+	stats.channels |= 1 << ((words[0] >> 16) & 0xf);
+	/* a MIDI 2.0 note on of velocity 0 is still a note on */
+	if ((words[0] >> 20 & 0xf) == 0x9 && (velocity || type == 4)) {
+		stats.notes++;
+		stats.pitches[note]++;
+		stats.velocities[velocity]++;
+	}
+}
+
+/* accumulates the per-take statistics for --summary */
+static void count_event(const snd_seq_event_t *ev)
+{
+	stats.messages++;
+	if (ump) {
+		count_ump(ev);
+		return;
+	}
+	if (ev->type == SND_SEQ_EVENT_SYSEX)
+		return;
+	stats.channels |= 1 << (ev->data.control.channel & 0xf);
+	if (ev->type == SND_SEQ_EVENT_NOTEON && ev->data.note.velocity) {
+		stats.notes++;
+		stats.pitches[ev->data.note.note & 0x7f]++;
+		stats.velocities[ev->data.note.velocity & 0x7f]++;
+	}
+}
+
+static void output_event(struct smf_track *track, const snd_seq_event_t *ev)
+{
+	unsigned int old_size = track->size;
+
+	encode_event(track, ev);
+	PROBE3(output_event, ev->time.tick, ev->type, track->size - old_size);
+	if (track->size == old_size)
+		return;
+	if (verify || seek_index || columns || note_index)
+		split_event(ev);
+	if (summary || catalog || retain)
+		count_event(ev);
+}
+
+/*
+ * A channel message of fixed size as a pack.h record without its delta
+ * time, or 0 for the other events.
+ */
+static uint32_t short_message(const snd_seq_event_t *ev)
+{
+	unsigned char ch = ev->data.control.channel & 0xf;
+	int value = ev->data.control.value;
+
+	switch (ev->type) {
+	case SND_SEQ_EVENT_NOTEON:
+		return PACK_RECORD(0, 0x90 | ch, ev->data.note.note & 0x7f,
+				   ev->data.note.velocity & 0x7f);
+	case SND_SEQ_EVENT_NOTEOFF:
+		return PACK_RECORD(0, 0x80 | ch, ev->data.note.note & 0x7f,
+				   ev->data.note.velocity & 0x7f);
+	case SND_SEQ_EVENT_KEYPRESS:
+		return PACK_RECORD(0, 0xa0 | ch, ev->data.note.note & 0x7f,
+				   ev->data.note.velocity & 0x7f);
+	case SND_SEQ_EVENT_CONTROLLER:
+		return PACK_RECORD(0, 0xb0 | ch, ev->data.control.param & 0x7f,
+				   value & 0x7f);
+	case SND_SEQ_EVENT_PGMCHANGE:
+		return PACK_RECORD(0, 0xc0 | ch, value & 0x7f, 0);
+	case SND_SEQ_EVENT_CHANPRESS:
+		return PACK_RECORD(0, 0xd0 | ch, value & 0x7f, 0);
+	case SND_SEQ_EVENT_PITCHBEND:
+		return PACK_RECORD(0, 0xe0 | ch, (value + 8192) & 0x7f,
+				   ((value + 8192) >> 7) & 0x7f);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The fast path of flush_buffer(): a run of channel messages of fixed
+ * size, each less than 128 ticks after the one before, is encoded by
+ * pack_messages() instead of a byte at a time.  Returns the number of
+ * events encoded, 0 if the first one is not such a message.  With the
+ * output_event probe enabled, every event goes through output_event()
+ * so that the probe sees it.
+ */
+static int output_run(struct smf_track *track, const snd_seq_event_t *events,
+		      int n)
+{
+	uint32_t records[PACK_BATCH];
+	uint64_t last_tick = track->last_tick;
+	int count, len;
+
+	if (n > PACK_BATCH)
+		n = PACK_BATCH;
+	/* t_start is set by the first event of the take */
+	if (ump || !t_start || PROBE_ENABLED(output_event) ||
+	    block_size - block_len < n * 4)
+		return 0;
+	for (count = 0; count < n; count++) {
+		const snd_seq_event_t *ev = &events[count];
+		snd_seq_tick_time_t tick = ev->time.tick - t_start;
+		int diff = tick - (snd_seq_tick_time_t)last_tick;
+		uint32_t msg;
+
+		if (ev->queue != queue || !snd_seq_ev_is_tick(ev) ||
+		    ev->dest.port != 0)
+			break;
+		if (diff < 0)
+			diff = 0;
+		msg = short_message(ev);
+		if (!msg || diff > 0x7f)
+			break;
+		records[count] = msg | diff;
+		last_tick += diff;
+	}
+	if (!count)
+		return 0;
+
+	len = pack_messages(block + block_len, records, count,
+			    &track->last_command);
+	block_len += len;
+	track->size += len;
+	track->last_tick = last_tick;
+	if (verify || seek_index || columns || note_index)
+		for (int i = 0; i < count; i++)
+			split_event(&events[i]);
+	if (summary || catalog || retain)
+		for (int i = 0; i < count; i++)
+			count_event(&events[i]);
+	return count;
+}
+
+/*
+ * The MIDI Clip File header: the Delta Clockstamp resolution, then the
+ * start of the clip.  There is no length; the clip ends at its End of
+ * Clip message.
+ */
+static void write_clip_header(void)
+{
+	unsigned char header[36] = "SMF2CLIP";
+	uint32_t words[7] = {
+		ump_delta(0), 0x00300000 | ticks,
+		ump_delta(0), 0xf0200000, 0, 0, 0
+	};
+
+	for (int i = 0; i < 7; i++) {
+		header[8 + 4 * i] = words[i] >> 24;
+		header[9 + 4 * i] = words[i] >> 16;
+		header[10 + 4 * i] = words[i] >> 8;
+		header[11 + 4 * i] = words[i];
+	}
+	track_offset = sizeof(header);
+#ifdef HAVE_ZSTD
+	if (compress) {
+		long offset = zseek_write_stored(&zseek, header, sizeof(header));
+
+		if (offset >= 0 && fflush(file))
+			offset = -errno;
+		if (offset < 0)
+			fatal("Cannot write file - %s", strerror(-offset));
+		return;
+	}
+#endif
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+	    fflush(file))
+		fatal("Cannot write file - %s", strerror(errno));
+}
+
+static void write_header(void)
+{
+	unsigned char header[22];
+	int time_division;
+
+	if (ump) {
+		write_clip_header();
+		return;
+	}
+	track_offset = sizeof(header);
+
+	/* header id and length */
+	memcpy(header, "MThd\0\0\0\6", 8);
+	/* type 0 or 1 */
+	header[8] = 0;
+	header[9] = false;
+	/* number of tracks */
+	header[10] = (1 >> 8) & 0xff;
+	header[11] = 1 & 0xff;
+	/* time division */
+	time_division = ticks;
+	if (smpte_timing)
+		time_division |= (0x100 - frames) << 8;
+	header[12] = time_division >> 8;
+	header[13] = time_division & 0xff;
+
+	/* track id */
+	memcpy(header + 14, "MTrk", 4);
+	
+	/* data length */
+	header[18] = (track.size >> 24) & 0xff;
+	header[19] = (track.size >> 16) & 0xff;
+	header[20] = (track.size >> 8) & 0xff;
+	header[21] = track.size & 0xff;
+
+	// Record where the length is stored, so we can update it
+	// when data is added to the file.
+#ifdef HAVE_ZSTD
+	if (compress) {
+		long offset = zseek_write_stored(&zseek, header, sizeof(header));
+
+		if (offset >= 0 && fflush(file))
+			offset = -errno;
+		if (offset < 0)
+			fatal("Cannot write file - %s", strerror(-offset));
+		size_offset = offset + 18;
+		return;
+	}
+#endif
+	size_offset = 18;
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+	    fflush(file))
+		fatal("Cannot write file - %s", strerror(errno));
+}
+
+/* record a variable-length quantity into buf, returns its size */
+static int var_value_buf(unsigned char *buf, int v)
+{
+	int n = 0;
+	
+	if (v >= (1 << 21))
+		buf[n++] = 0x80 | ((v >> 21) & 0x7f);
+	if (v >= (1 << 14))
+		buf[n++] = 0x80 | ((v >> 14) & 0x7f);
+	if (v >= (1 << 7))
+		buf[n++] = 0x80 | ((v >> 7) & 0x7f);
+	buf[n++] = v & 0x7f;
+	return n;
+}
+
+/* builds the end of track, or the end of clip, 'diff' ticks after the last event */
+static int track_end(unsigned char *end, int diff)
+{
+	static const unsigned char end_of_clip[16] = { 0xf0, 0x21 };
+	int len;
+
+	if (ump) {
+		uint32_t delta = ump_delta(diff);
+
+		end[0] = delta >> 24;
+		end[1] = delta >> 16;
+		end[2] = delta >> 8;
+		end[3] = delta;
+		memcpy(end + 4, end_of_clip, sizeof(end_of_clip));
+		return 4 + sizeof(end_of_clip);
+	}
+	len = var_value_buf(end, diff);
+	end[len++] = 0xff;
+	end[len++] = 0x2f;
+	len += var_value_buf(end + len, 0);
+	return len;
+}
+
+/* the file offset where the next block goes */
+static long output_end(void)
+{
+#ifdef HAVE_ZSTD
+	if (compress)
+		return zseek.data_end;
+#endif
+	return track_offset + track.size - block_len;
+}
+
+/*
+ * Allocates disk space up to 'end' and some more, without changing the
+ * file size, so that the writes before it cannot fail for lack of
+ * space.  Returns 0 or -errno.
+ */
+static int reserve_space(long end)
+{
+	if (end <= reserved)
+		return 0;
+	end += RESERVE_SIZE;
+	if (fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, reserved,
+		      end - reserved) < 0) {
+		if (errno != EOPNOTSUPP)
+			return -errno;
+		/* not on this file system; the writes are still checked */
+		end = LONG_MAX;
+	}
+	reserved = end;
+	return 0;
+}
+
+/* puts back the end of track after a block could not be written */
+static void restore_track_end(void)
+{
+	int err = 0;
+
+#ifdef HAVE_ZSTD
+	if (compress)
+		err = zseek_write_trailer(&zseek, last_end, last_end_len);
+	else
+#endif
+	if (fseek(file, output_end(), SEEK_SET) ||
+	    fwrite(last_end, 1, last_end_len, file) != (size_t)last_end_len ||
+	    fflush(file) ||
+	    ftruncate(fileno(file), output_end() + last_end_len) < 0)
+		err = -errno;
+	if (err < 0)
+		fprintf(stderr, "Cannot restore the end of %s - %s\n", take_path,
+			strerror(-err));
+}
+
+/*
+ * Writes the encoded data into space allocated ahead.  When the disk is
+ * full, the data stays in memory, the file keeps its last end of track
+ * and length, and the write is tried again at the next flush.
+ */
+static void write_block(void)
+{
+	long end = output_end() + block_len + RESERVE_MARGIN;
+	int err;
+
+	if (!block_len)
+		return;
+#ifdef HAVE_ZSTD
+	if (compress)
+		end += zseek.count * sizeof(struct zseek_frame);
+#endif
+	err = reserve_space(end);
+	if (!err) {
+#ifdef HAVE_ZSTD
+		if (compress)
+			err = zseek_write_block(&zseek, block, block_len);
+		else
+#endif
+		if (fseek(file, output_end(), SEEK_SET) ||
+		    fwrite(block, 1, block_len, file) != (size_t)block_len ||
+		    fflush(file))
+			err = -errno;
+		if (err < 0)
+			restore_track_end();
+	}
+	if (err < 0) {
+		if (!disk_full)
+			fprintf(stderr, "Cannot write %s - %s; keeping events in memory\n",
+				take_path, strerror(-err));
+		disk_full = true;
+		return;
+	}
+	if (disk_full)
+		fprintf(stderr, "Writing %s again, %d bytes kept in memory\n",
+			take_path, block_len);
+	disk_full = false;
+	block_len = 0;
+}
+
+/* records the encoder state once 'events' queued events are encoded */
+static void commit(int events)
+{
+	committed.size = track.size;
+	committed.block_len = block_len;
+	committed.events = events;
+	committed.last_tick = track.last_tick;
+	committed.t_start = t_start;
+	committed.last_command = track.last_command;
+}
+
+static void rollback(void)
+{
+	track.size = committed.size;
+	block_len = committed.block_len;
+	track.last_tick = committed.last_tick;
+	t_start = committed.t_start;
+	track.last_command = committed.last_command;
+}
+
+static snd_seq_tick_time_t queue_tick(void);
+
+/* sorts the queue by tick, stably; it is nearly sorted already */
+static void sort_queue(void)
+{
+	snd_seq_event_t *q = track.event_queue;
+
+	for (int i = 1; i < track.event_queue_size; i++) {
+		snd_seq_event_t ev = q[i];
+		int j = i;
+
+		while (j > 0 && (int)(q[j - 1].time.tick - ev.time.tick) > 0) {
+			q[j] = q[j - 1];
+			j--;
+		}
+		q[j] = ev;
+	}
+}
+
+/*
+ * With --latency: sorts the queue, and returns how many events can be
+ * encoded, those no event still to come can precede (or all of them).
+ */
+static int ready_events(bool all)
+{
+	int n = track.event_queue_size, ready = 0;
+	snd_seq_tick_time_t bound;
+
+	sort_queue();
+	if (all)
+		return n;
+	bound = queue_tick() - latency_hold;
+	while (ready < n && (int)(track.event_queue[ready].time.tick - bound) <= 0)
+		ready++;
+	/* leave room for the next events */
+	if (n - ready > queue_size / 2)
+		ready = n - queue_size / 2;
+	return ready;
+}
+
+/* whether the data of an event is kept in the SysEx arena */
+static bool has_arena_data(const snd_seq_event_t *ev)
+{
+	/* UMP words and marker labels are kept like SysEx data */
+	return ev->type == SND_SEQ_EVENT_SYSEX ||
+		ev->type == EVENT_MARKER || ump;
+}
+
+/*
+ * Moves the events not encoded to the front, their data to the other
+ * arena.  Every held event stays complete, at its old place or at the
+ * front, and 'held' says where, so that emergency_finish() can still
+ * encode them all; the queue size is updated last.
+ */
+static void hold_back(int ready)
+{
+	unsigned char *arena = sysex_arena == sysex_arenas[0] ?
+		sysex_arenas[1] : sysex_arenas[0];
+	int n = track.event_queue_size - ready;
+
+	sysex_len = 0;
+	for (int i = ready; i < track.event_queue_size; i++) {
+		snd_seq_event_t *ev = &track.event_queue[i];
+
+		if (has_arena_data(ev)) {
+			memcpy(arena + sysex_len, ev->data.ext.ptr, ev->data.ext.len);
+			ev->data.ext.ptr = arena + sysex_len;
+			sysex_len += ev->data.ext.len;
+		}
+	}
+	held.from = ready;
+	held.size = track.event_queue_size;
+	held.moved = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	holding = 1;
+	/* moving forwards only overwrites events already moved */
+	for (int i = 0; i < n; i++) {
+		track.event_queue[i] = track.event_queue[ready + i];
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		held.moved = i + 1;
+	}
+	track.event_queue_size = n;
+	encoded = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	holding = 0;
+	if (n)
+		sysex_arena = arena;
+}
+
+/* --max-risk: the ticks an event may wait, less the time a flush takes */
+static snd_seq_tick_time_t risk_ticks(void)
+{
+	return us_to_ticks(max_risk * 1000.0 > flow.write_us ?
+			   max_risk * 1000.0 - flow.write_us : 0);
+}
+
+/* encodes the queue, or with 'all' unset, the events ready to be */
+static void flush_buffer(bool all)
+{
+	unsigned long long start = PROBE_ENABLED(flush_buffer) ? now_ns() : 0;
+	int events = latency_count ? ready_events(all) : track.event_queue_size;
+
+	if (disk_full && block_len >= SPILL_MAX) {
+		lost_events += events;
+	} else {
+		commit(0);
+		encode_end = events;
+		encoding = 1;
+		for (int i=0; i<events; ) {
+			int run = output_run(&track, &track.event_queue[i],
+					     events - i);
+
+			if (!run) {
+				output_event(&track, &track.event_queue[i]);
+				run = 1;
+			}
+			i += run;
+			commit(i);
+		}
+	}
+	/* from here on, emergency_finish() encodes the rest of the queue */
+	encoded = events;
+	encoding = 0;
+	if (columns && cols_file)
+		write_row_group();
+	if (note_index && notes_file)
+		write_notes();
+	hold_back(events);
+	flow.arrived = 0;
+	/*
+	 * The events held back by --latency are due once they are ready,
+	 * and --max-risk after that, even if no more arrive.  The queue is
+	 * sorted, the oldest first.
+	 */
+	if (max_risk && track.event_queue_size)
+		flow.deadline = track.event_queue[0].time.tick + latency_hold +
+			risk_ticks();
+	write_block();
+
+	PROBE3(flush_buffer, events, track.size,
+	       PROBE_ENABLED(flush_buffer) ? now_ns() - start : 0);
+}
+
+static void update_length(int extra_size)
+{
+	unsigned long long start = PROBE_ENABLED(update_length) ? now_ns() : 0;
+
+	/* a clip has no length */
+	if (ump)
+		return;
+
+	// Save position
+	long saved_pos = ftell(file);
+	
+	// Jump back to where we recorded the length
+	fseek(file, size_offset, SEEK_SET);
+	
+	/* the track end is not part of track.size; it is overwritten by the next flush */
+	unsigned int size = track.size + extra_size;
+	unsigned char length[4] = { size >> 24, size >> 16, size >> 8, size };
+	
+	if (fwrite(length, 1, 4, file) != 4 || fflush(file))
+		fprintf(stderr, "Cannot update the length of %s - %s\n",
+			take_path, strerror(errno));
+	
+	// Jump back to where we were
+	fseek(file, saved_pos, SEEK_SET);
+
+	PROBE2(update_length, size,
+	       PROBE_ENABLED(update_length) ? now_ns() - start : 0);
+}
+
+/* the current queue time; the virtual clock when replaying */
+static snd_seq_tick_time_t queue_tick(void)
+{
+	snd_seq_queue_status_t *queue_status;
+	int err;
+
+	if (replay)
+		return replay_tick;
+	if (rawmidi_device)
+		return rawmidi_tick(now_ns());
+	snd_seq_queue_status_alloca(&queue_status);
+	err = snd_seq_get_queue_status(seq, queue, queue_status);
+	check_snd("get queue status", err);
+	return snd_seq_queue_status_get_tick_time(queue_status);
+}
+
+static int write_track_end(void)
+{
+	unsigned char end[TRACK_END_MAX];
+	snd_seq_tick_time_t tick;
+	int diff, err;
+	int extra_size;
+
+	/* make length of first (and only) track the recording length */
+	tick = queue_tick() - t_start;
+	diff = tick - (snd_seq_tick_time_t)track.last_tick;
+	if (diff < 0)
+		diff = 0;
+	if (diff > (ump ? UMP_DELTA_MAX : MAX_DELTA))
+		diff = ump ? UMP_DELTA_MAX : MAX_DELTA;
+	extra_size = track_end(end, diff);
+	end_tick = track.last_tick + diff;
+
+#ifdef HAVE_ZSTD
+	if (compress) {
+		/* the trailer; the next block is written over it */
+		err = zseek_write_trailer(&zseek, end, extra_size);
+	} else
+#endif
+	err = !fseek(file, output_end(), SEEK_SET) &&
+		fwrite(end, 1, extra_size, file) == (size_t)extra_size &&
+		!fflush(file) ? 0 : -errno;
+	/* within the reserved space, this only fails on I/O errors */
+	if (err < 0)
+		fprintf(stderr, "Cannot write the end of %s - %s\n", take_path,
+			strerror(-err));
+	memcpy(last_end, end, extra_size);
+	last_end_len = extra_size;
+
+	PROBE3(write_track_end, tick, track.last_tick, extra_size);
+	return extra_size;
+}
+
+static int write_temporary_track_end(void)
+{
+	long saved_pos = ftell(file);
+	int extra_size = write_track_end();
+	fseek(file, saved_pos, SEEK_SET);
+	return extra_size;
+}
+
+/* writes all of the data at offset, returns 0 or a negative errno */
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, data, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		data = (const char *)data + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* for emergency_finish(): encodes queued events while the block has room */
+static bool encode_queued(int from, int to)
+{
+	for (int i = from; i < to; i++) {
+		commit(i);
+		encode_event(&track, &track.event_queue[i]);
+		if (block_full) {
+			rollback();
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Finishes the take after a fatal error or a crash: encodes the queued
+ * events, then writes them, an end of track and the length.  Only
+ * memory allocated beforehand and async-signal-safe calls are used, so
+ * that it can run in a signal handler: the block is not grown, and the
+ * file is written with pwrite() around stdio.  An event whose encoding
+ * was interrupted is dropped, and so are the events that do not fit in
+ * the block.  Returns whether a take was finished.
+ */
+static bool emergency_finish(void)
+{
+	unsigned char end[TRACK_END_MAX], length[4];
+	int first = 0, end_len, err;
+	unsigned int size;
+	long pos;
+
+	if (emergency || file_fd < 0)
+		return false;
+	emergency = 1;
+
+	if (holding) {
+		/* hold_back() was interrupted: the events moved, then the rest */
+		if (encode_queued(0, held.moved))
+			encode_queued(held.from + held.moved, held.size);
+	} else {
+		first = encoded;
+		if (encoding) {
+			/* flush_buffer() was interrupted in the middle of an event */
+			rollback();
+			first = committed.events < encode_end ?
+				committed.events + 1 : committed.events;
+		}
+		encode_queued(first, track.event_queue_size);
+	}
+
+	end_len = track_end(end, 0);
+	pos = output_end();
+#ifdef HAVE_ZSTD
+	if (compress) {
+		err = zseek_write_emergency(&zseek, file_fd, block, block_len,
+					    end, end_len);
+		/* at least the old trailer again */
+		if (err < 0)
+			zseek_write_emergency(&zseek, file_fd, NULL, 0,
+					      last_end, last_end_len);
+	} else
+#endif
+	{
+		err = pwrite_all(file_fd, block, block_len, pos);
+		if (!err)
+			err = pwrite_all(file_fd, end, end_len, pos + block_len);
+		if (!err && ftruncate(file_fd, pos + block_len + end_len) < 0)
+			err = -errno;
+		if (err < 0)
+			pwrite_all(file_fd, last_end, last_end_len, pos);
+	}
+	if (!err && !ump) {
+		size = track.size + end_len;
+		length[0] = size >> 24;
+		length[1] = size >> 16;
+		length[2] = size >> 8;
+		length[3] = size;
+		pwrite_all(file_fd, length, 4, size_offset);
+	}
+	fsync(file_fd);
+	return true;
+}
+
+/* SIGSEGV, SIGBUS and SIGABRT: save the take, then die of the signal */
+static void crash_handler(int sig)
+{
+	static const char msg[] = "Crashed, finishing the take\n";
+
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	emergency_finish();
+	raise(sig);
+}
+
+static void catch_crashes(void)
+{
+	static char stack[CRASH_STACK_SIZE];	/* a stack overflow is a crash too */
+	stack_t ss = { .ss_sp = stack, .ss_size = sizeof(stack) };
+	struct sigaction sa = { .sa_handler = crash_handler,
+				.sa_flags = SA_RESETHAND | SA_ONSTACK };
+
+	sigaltstack(&ss, NULL);
+	sigaction(SIGSEGV, &sa, NULL);
+	sigaction(SIGBUS, &sa, NULL);
+	sigaction(SIGABRT, &sa, NULL);
+}
+
+/*
+ * Adds a point to the seek index: after a flush the next event starts
+ * at track.size, and decoding can start there with this state.
+ */
+static void write_seek_point(void)
+{
+	static struct smf_seek_point point;
+
+	point.tick = track.last_tick;
+	point.offset = track.size;
+	point.running_status = track.last_command;
+	point.state = seek_state;
+	if (fwrite(&point, sizeof(point), 1, seek_file) != 1 ||
+	    fflush(seek_file)) {
+		fprintf(stderr, "Cannot write seek index - %s; it ends here\n",
+			strerror(errno));
+		fclose(seek_file);
+		seek_file = NULL;
+	}
+	seek_size = track.size;
+}
+
+static void open_seek_index(const char *filename)
+{
+	struct smf_seek_header header = {
+		.magic = SMF_SEEK_MAGIC,
+		.point_size = sizeof(struct smf_seek_point),
+		.division = smpte_timing ? ((0x100 - frames) << 8) | ticks : ticks,
+	};
+	char path[PATH_MAX + sizeof(".seek")];
+
+	snprintf(path, sizeof(path), "%s.seek", filename);
+	seek_file = fopen(path, "wb");
+	if (!seek_file)
+		fatal("Cannot open %s - %s", path, strerror(errno));
+	seek_size = 0;
+	if (fwrite(&header, sizeof(header), 1, seek_file) != 1)
+		fatal("Cannot write %s - %s", path, strerror(errno));
+	smf_state_init(&seek_state);
+}
+
+/* opens <filename>.cols, with room for the messages of a flush */
+static void open_columns(const char *filename)
+{
+	struct smf_cols_header header = {
+		.magic = SMF_COLS_MAGIC,
+		.group_size = sizeof(struct smf_cols_group),
+		.division = smpte_timing ? ((0x100 - frames) << 8) | ticks : ticks,
+	};
+	/* a (N)RPN event makes four messages */
+	int size = queue_size * 4;
+	char path[PATH_MAX + sizeof(".cols")];
+
+	if (cols.size < size) {
+		cols.tick = realloc(cols.tick, size * sizeof(*cols.tick));
+		cols.type = realloc(cols.type, size);
+		cols.channel = realloc(cols.channel, size);
+		cols.data1 = realloc(cols.data1, size);
+		cols.data2 = realloc(cols.data2, size);
+		cols.payload = realloc(cols.payload, size * sizeof(*cols.payload));
+		cols.length = realloc(cols.length, size * sizeof(*cols.length));
+		if (!cols.tick || !cols.type || !cols.channel || !cols.data1 ||
+		    !cols.data2 || !cols.payload || !cols.length)
+			fatal("Out of memory");
+		cols.size = size;
+	}
+	cols.rows = 0;
+	snprintf(path, sizeof(path), "%s.cols", filename);
+	cols_file = fopen(path, "wb");
+	if (!cols_file)
+		fatal("Cannot open %s - %s", path, strerror(errno));
+	if (fwrite(&header, sizeof(header), 1, cols_file) != 1)
+		fatal("Cannot write %s - %s", path, strerror(errno));
+}
+
+/* opens <filename>.notes, with room for the notes a flush can end */
+static void open_note_index(const char *filename)
+{
+	struct smf_notes_header header = {
+		.magic = SMF_NOTES_MAGIC,
+		.note_size = sizeof(struct smf_note),
+		.division = smpte_timing ? ((0x100 - frames) << 8) | ticks : ticks,
+	};
+	/* each event ends at most one note; the end of the take all of them */
+	int size = queue_size > 16 * 128 ? queue_size : 16 * 128;
+	char path[PATH_MAX + sizeof(".notes")];
+
+	if (notes_size < size) {
+		notes = realloc(notes, size * sizeof(*notes));
+		if (!notes)
+			fatal("Out of memory");
+		notes_size = size;
+	}
+	notes_count = 0;
+	memset(open_notes, 0, sizeof(open_notes));
+	snprintf(path, sizeof(path), "%s.notes", filename);
+	notes_file = fopen(path, "wb");
+	if (!notes_file)
+		fatal("Cannot open %s - %s", path, strerror(errno));
+	if (fwrite(&header, sizeof(header), 1, notes_file) != 1)
+		fatal("Cannot write %s - %s", path, strerror(errno));
+}
+
+/* ends the notes still held at the end of the take, and closes the index */
+static void close_note_index(void)
+{
+	for (int ch = 0; ch < 16; ch++)
+		for (int key = 0; key < 128; key++)
+			if (open_notes[ch][key].velocity)
+				end_note(ch, key, end_tick > open_notes[ch][key].start ?
+					 end_tick : open_notes[ch][key].start,
+					 0, SMF_NOTE_HELD);
+	write_notes();
+	if (notes_file) {
+		fclose(notes_file);
+		notes_file = NULL;
+	}
+}
+
+static void start_take(void);
+static void finish_take(void);
+
+/*
+ * Once at startup: with --max-flush-rate or --max-risk, a queue for
+ * the events arriving at EVENT_RATE_MAX between two flushes, up to
+ * FLUSH_QUEUE_MAX, and arenas for its SysEx data.  Nothing is
+ * allocated for them while recording.
+ */
+static void size_buffers(void)
+{
+#ifndef SMALL_FOOTPRINT
+	if (adaptive) {
+		double s = max_flush_rate > 0 ? 1 / max_flush_rate : 0;
+		double size;
+
+		if (max_risk && (!s || max_risk / 1000.0 < s))
+			s = max_risk / 1000.0;
+		size = ceil(EVENT_RATE_MAX * s);
+		if (size > FLUSH_QUEUE_MAX)
+			size = FLUSH_QUEUE_MAX;
+		if (size > queue_size) {
+			queue_size = size;
+			sysex_arena_size = (unsigned long)SYSEX_ARENA_SIZE *
+				queue_size / EVENT_QUEUE_SIZE;
+			if (sysex_arena_size > SYSEX_ARENA_MAX)
+				sysex_arena_size = SYSEX_ARENA_MAX;
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		sysex_arenas[i] = malloc(sysex_arena_size);
+		if (!sysex_arenas[i])
+			fatal("Out of memory");
+	}
+	sysex_arena = sysex_arenas[0];
+#endif
+	flow.flush_at = queue_size;
+}
+
+/*
+ * After a flush: measures the arrival rate of the events and how long
+ * the flush took, and sets the number of events that makes the next one
+ * so that there are at most --max-flush-rate flushes a second.
+ */
+static void adapt_flush(int arrived, unsigned long long write_ns)
+{
+	snd_seq_tick_time_t now = queue_tick();
+	double s = ticks_to_us(now - flow.last_flush) / 1e6;
+	double us = write_ns / 1000.0;
+
+	if (s <= 0)
+		s = ticks_to_us(1) / 1e6;
+	flow.last_flush = now;
+	flow.rate = flow.rate ? 0.75 * flow.rate + 0.25 * arrived / s : arrived / s;
+	flow.write_us = us > 0.9 * flow.write_us ? us : 0.9 * flow.write_us;
+	if (max_flush_rate > 0) {
+		double at = ceil(flow.rate / max_flush_rate);
+
+		if (at > queue_size) {
+			/* over FLUSH_QUEUE_MAX: more flushes than asked */
+			at = queue_size;
+			flush_stats.capped++;
+		}
+		flow.flush_at = at < 1 ? 1 : at;
+	}
+
+	if (!flush_stats.flushes || flow.flush_at < flush_stats.min_at)
+		flush_stats.min_at = flow.flush_at;
+	if (flow.flush_at > flush_stats.max_at)
+		flush_stats.max_at = flow.flush_at;
+	if (us > flush_stats.write_max_us)
+		flush_stats.write_max_us = us;
+	flush_stats.flushes++;
+	PROBE3(flush_control, flow.flush_at, (unsigned long)flow.rate,
+	       (unsigned long)us);
+}
+
+/* writes out the queue, leaving a complete file */
+static void write_queue(bool all)
+{
+	unsigned long long start = adaptive ? now_ns() : 0;
+	int arrived = flow.arrived;
+
+	flush_buffer(all);
+	/* else the file keeps its last end of track */
+	if (!disk_full) {
+		int extra_size = write_temporary_track_end();
+		update_length(extra_size);
+		if (seek_index && seek_file &&
+		    track.size - seek_size >= SEEK_INTERVAL)
+			write_seek_point();
+	}
+	if (adaptive)
+		adapt_flush(arrived, now_ns() - start);
+	if (track.size > TRACK_SIZE_MAX) {
+		/* close to what the 32-bit MTrk length can hold */
+		if (rotate) {
+			finish_take();
+			start_take();
+		} else if (!stop) {
+			fprintf(stderr, "%s is full, stopping\n", take_path);
+			stop = 1;
+		}
+	}
+}
+
+static void record_event(const snd_seq_event_t *ev)
+{
+	bool sysex = has_arena_data(ev);
+	snd_seq_event_t *queued;
+
+	PROBE3(record_event, ev->time.tick, ev->type, track.event_queue_size);
+
+#ifdef SMALL_FOOTPRINT
+	/* the block only has room for an arena of it */
+	if (sysex && ev->data.ext.len > SYSEX_ARENA_SIZE) {
+		lost_events++;
+		return;
+	}
+#endif
+	if (track.event_queue_size >= queue_size ||
+	    (sysex && ev->data.ext.len > sysex_arena_size - sysex_len))
+		write_queue(false);
+	
+	queued = &track.event_queue[track.event_queue_size++];
+	*queued = *ev;
+	if (latency_count)
+		queued->time.tick -= source_latency(&ev->source);
+	if (sysex) {
+		/* the sequencer reuses its buffer for the next events */
+		if (ev->data.ext.len <= sysex_arena_size - sysex_len) {
+			memcpy(sysex_arena + sysex_len, ev->data.ext.ptr,
+			       ev->data.ext.len);
+			queued->data.ext.ptr = sysex_arena + sysex_len;
+			sysex_len += ev->data.ext.len;
+		} else {
+			/* larger than the arena: encoded while still valid */
+			write_queue(true);
+			return;
+		}
+	}
+	/* --max-risk counts from the first event of an empty queue */
+	flow.arrived++;
+	if (track.event_queue_size == 1 && max_risk)
+		flow.deadline = ev->time.tick + risk_ticks();
+	if (adaptive && flow.arrived >= flow.flush_at)
+		write_queue(false);
+}
+
+/* with --max-risk: writes the queue when its first event is due */
+static void flush_due(void)
+{
+	if (!max_risk || !track.event_queue_size ||
+	    (int)(queue_tick() - flow.deadline) < 0)
+		return;
+	flush_stats.at_deadline++;
+	write_queue(false);
+}
+
+/* ms until flush_due() has to be called, or -1 */
+static int flush_wait(void)
+{
+	int ticks;
+
+	if (!max_risk || !track.event_queue_size)
+		return -1;
+	ticks = flow.deadline - queue_tick();
+	return ticks <= 0 ? 0 : (int)ceil(ticks_to_us(ticks) / 1000);
+}
+
+#ifdef HAVE_UMP
+/* queues a UMP event, pointing to its words as variable-length data */
+static void record_ump_event(const snd_seq_ump_event_t *ump_event)
+{
+	snd_seq_event_t ev;
+
+	memcpy(&ev, ump_event, offsetof(snd_seq_event_t, data));
+	ev.data.ext.len = ump_words(ump_event->ump[0]) * 4;
+	ev.data.ext.ptr = (void *)ump_event->ump;
+	record_event(&ev);
+}
+#endif
+
+/*
+ * A closed take, with a copy of what was recorded into it, for the work
+ * that follows: its summary, catalog entry and check, its migration and
+ * its place in the quota.  That is done on the finisher thread, so that
+ * the capture loop goes on with the next take at once.
+ */
+struct finished_take {
+	struct finished_take *next;
+	char take_path[PATH_MAX];	/* where it was written */
+	char dest_path[PATH_MAX];	/* and where it ends up */
+	unsigned long long start_us;	/* since the epoch */
+	uint64_t end_tick;
+	double duration_us;
+	struct take_stats stats;
+	struct flush_stats flush_stats;
+	struct flow flow;
+	struct expected expected;
+};
+
+static void print_histogram(FILE *f, const char *name, const unsigned long *h)
+{
+	fprintf(f, "%s:", name);
+	for (int i = 0; i < 128; i++)
+		fprintf(f, " %lu", h[i]);
+	fputc('\n', f);
+}
+
+/*
+ * Writes the statistics of the take to <take>.summary, replacing any
+ * previous one atomically so that readers never see half a file.
+ */
+static void write_summary(const struct finished_take *t)
+{
+	char path[PATH_MAX + sizeof(".summary")], tmp[sizeof(path) + 4];
+	double duration = t->duration_us / 1e6;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s.summary", t->take_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	/* a missing summary must not stop the recording */
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot open %s - %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	fprintf(f, "start_us: %llu\n", t->start_us);
+	fprintf(f, "port: %d:%d\n", port.client, port.port);
+	fprintf(f, "division: %d\n", smpte_timing ?
+		((0x100 - frames) << 8) | ticks : ticks);
+	fprintf(f, "queue_tempo: %u/%d\n", queue_tempo, queue_ppq);
+	fprintf(f, "duration_ticks: %llu\n", (unsigned long long)t->end_tick);
+	fprintf(f, "duration: %.3f\n", duration);
+	fprintf(f, "messages: %lu\n", t->stats.messages);
+	fprintf(f, "notes: %lu\n", t->stats.notes);
+	fprintf(f, "notes_per_second: %.3f\n",
+		duration > 0 ? t->stats.notes / duration : 0);
+	fprintf(f, "channels:");
+	for (int ch = 0; ch < 16; ch++)
+		if (t->stats.channels & (1 << ch))
+			fprintf(f, " %d", ch + 1);
+	fputc('\n', f);
+	fprintf(f, "key: %s\n",
+		catalog_key_name(catalog_estimate_key(t->stats.pitches)));
+	print_histogram(f, "pitches", t->stats.pitches);
+	print_histogram(f, "velocities", t->stats.velocities);
+	if (adaptive) {
+		fprintf(f, "flushes: %lu\n", t->flush_stats.flushes);
+		fprintf(f, "flushes_at_deadline: %lu\n", t->flush_stats.at_deadline);
+		fprintf(f, "flush_rate_capped: %lu\n", t->flush_stats.capped);
+		fprintf(f, "flush_threshold: %d %d %d\n", t->flow.flush_at,
+			t->flush_stats.min_at, t->flush_stats.max_at);
+		fprintf(f, "event_rate: %.1f\n", t->flow.rate);
+		fprintf(f, "write_latency_us: %.0f %.0f\n", t->flow.write_us,
+			t->flush_stats.write_max_us);
+	}
+
+	if (fflush(f) || fsync(fileno(f)) || ferror(f)) {
+		fprintf(stderr, "Cannot write %s - %s\n", tmp, strerror(errno));
+		fclose(f);
+		unlink(tmp);
+		return;
+	}
+	fclose(f);
+	if (rename(tmp, path) < 0)
+		fprintf(stderr, "Cannot rename %s - %s\n", tmp, strerror(errno));
+}
+
+/* appends the take to the --catalog file */
+static void add_to_catalog(const struct finished_take *t)
+{
+	struct catalog_entry entry = { };
+	char dir[PATH_MAX], path[PATH_MAX];
+	const char *filename = t->dest_path;
+	const char *slash = strrchr(filename, '/');
+	const char *name = slash ? slash + 1 : filename;
+	int err;
+
+	/* only the directory: the take may still be in the staging directory */
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - filename) : 1,
+		 slash ? filename : ".");
+	if (!realpath(*dir ? dir : "/", path)) {
+		fprintf(stderr, "Not added to catalog %s: cannot resolve %s - %s\n",
+			catalog, filename, strerror(errno));
+		return;
+	}
+	if (snprintf(entry.path, sizeof(entry.path), "%s/%s",
+		     strcmp(path, "/") ? path : "", name) >= (int)sizeof(entry.path)) {
+		/* a missing entry must not stop the recording */
+		fprintf(stderr, "Not added to catalog %s: the path of %s is longer than %d bytes\n",
+			catalog, filename, (int)sizeof(entry.path) - 1);
+		return;
+	}
+	entry.start_us = t->start_us;
+	entry.duration_ms = t->duration_us / 1000;
+	entry.notes = t->stats.notes;
+	entry.messages = t->stats.messages;
+	entry.channels = t->stats.channels;
+	entry.client = port.client;
+	entry.port = port.port;
+	entry.key = catalog_estimate_key(t->stats.pitches);
+
+	err = catalog_append(catalog, &entry);
+	if (err < 0)
+		fprintf(stderr, "Cannot add to catalog %s - %s\n", catalog,
+			strerror(-err));
+}
+
+/*
+ * Reads the finished file back with the independent decoder and checks
+ * that its structure is sound and that it contains exactly the messages
+ * that were recorded.
+ */
+static int verify_file(const struct finished_take *t)
+{
+	const char *filename = t->take_path;
+	struct smf_header header;
+	struct smf_decoder d;
+	struct smf_event ev;
+	unsigned char *buf;
+	uint64_t hash = FNV_OFFSET;
+	unsigned long messages = 0;
+	int division, err;
+	long len;
+	FILE *f;
+
+	/* on the finisher thread: a failure fails the check, not the recording */
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "Verify: cannot open %s - %s\n", filename,
+			strerror(errno));
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	buf = malloc(len ? len : 1);
+	if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "Verify: cannot read %s\n", filename);
+		free(buf);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+#ifdef HAVE_ZSTD
+	if (compress) {
+		unsigned char *data;
+		size_t size;
+
+		data = zseek_decompress(buf, len, &size);
+		free(buf);
+		if (!data) {
+			fputs("Verify: invalid seekable zstd file\n", stderr);
+			return 1;
+		}
+		buf = data;
+		len = size;
+	}
+#endif
+
+	err = smf_read_header(buf, len, &header);
+	if (err != SMF_EVENT) {
+		fprintf(stderr, "Verify: %s\n", smf_strerror(err));
+		return 1;
+	}
+	division = smpte_timing ? ((0x100 - frames) << 8) | ticks : ticks;
+	if (header.format != 0 || header.tracks != 1 ||
+	    header.division != division) {
+		fprintf(stderr, "Verify: header says format %d, %d tracks, division %#x\n",
+			header.format, header.tracks, header.division);
+		return 1;
+	}
+	if (header.track_offset + header.track_length != (size_t)len) {
+		fprintf(stderr, "Verify: MTrk length %u, but %ld bytes follow\n",
+			header.track_length, len - (long)header.track_offset);
+		return 1;
+	}
+
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, buf + header.track_offset, 0,
+			     header.track_length);
+	while ((err = smf_decode_event(&d, &ev)) == SMF_EVENT) {
+		if (ev.status < 0xf0) {
+			hash = hash_message(hash, ev.tick, ev.status, ev.data,
+					    smf_message_length(ev.status));
+			messages++;
+		} else if (ev.status != 0xff) {
+			hash = hash_message(hash, ev.tick, ev.status,
+					    ev.payload, ev.length);
+			messages++;
+		}
+	}
+	free(buf);
+	if (err != SMF_NEED_MORE || d.pos != header.track_length) {
+		fprintf(stderr, "Verify: %s at track offset %zu\n",
+			smf_strerror(err), d.pos);
+		return 1;
+	}
+	if (!d.ended) {
+		fputs("Verify: no end of track\n", stderr);
+		return 1;
+	}
+	if (messages != t->expected.messages || hash != t->expected.hash) {
+		fprintf(stderr, "Verify: %lu messages decoded, %lu recorded%s\n",
+			messages, t->expected.messages,
+			messages == t->expected.messages ? ", but they differ" : "");
+		return 1;
+	}
+	fprintf(stderr, "Verify: %lu messages OK\n", messages);
+	return 0;
+}
+
+/* the tempo and time signature at the start of each take */
+static void write_tempo(void)
+{
+	int usecs_per_quarter = 60000000 / beats;
+
+	if (smpte_timing)
+		return;
+	if (ump) {
+		/* Flex Data: Set Tempo, in units of 10 ns, and Set Time Signature */
+		add_word(&track, ump_delta(0));
+		add_word(&track, 0xd0100000);
+		add_word(&track, usecs_per_quarter * 100);
+		add_word(&track, 0);
+		add_word(&track, 0);
+		add_word(&track, ump_delta(0));
+		add_word(&track, 0xd0100001);
+		add_word(&track, ts_num << 24 | ts_dd << 16 | 8 << 8);
+		add_word(&track, 0);
+		add_word(&track, 0);
+		return;
+	}
+	var_value(&track, 0); /* delta time */
+	add_byte(&track, 0xff);
+	add_byte(&track, 0x51);
+	var_value(&track, 3);
+	add_byte(&track, usecs_per_quarter >> 16);
+	add_byte(&track, usecs_per_quarter >> 8);
+	add_byte(&track, usecs_per_quarter);
+
+	/* time signature */
+	var_value(&track, 0); /* delta time */
+	add_byte(&track, 0xff);
+	add_byte(&track, 0x58);
+	var_value(&track, 4);
+	add_byte(&track, ts_num);
+	add_byte(&track, ts_dd);
+	add_byte(&track, 24); /* MIDI clocks per metronome click */
+	add_byte(&track, 8); /* notated 32nd-notes per MIDI quarter note */
+}
+
+/* sets take_path for dest_path */
+static void stage_take(void)
+{
+	if (staging) {
+		const char *name = strrchr(dest_path, '/');
+
+		if (snprintf(take_path, sizeof(take_path), "%s/%s", staging,
+			     name ? name + 1 : dest_path) >= (int)sizeof(take_path))
+			fatal("The path of %s in %s is too long", dest_path, staging);
+	} else {
+		snprintf(take_path, sizeof(take_path), "%s", dest_path);
+	}
+}
+
+/* sets dest_path and take_path for a take starting now */
+static void name_take(void)
+{
+	if (rotate) {
+		/* when replaying, the names follow the virtual clock */
+		time_t now = replay ? (start_time + ticks_to_us(replay_tick)) / 1000000 :
+			time(NULL);
+
+		if (!strftime(dest_path, sizeof(dest_path), output,
+			      localtime(&now)))
+			fatal("Invalid file name pattern %s", output);
+	} else {
+		snprintf(dest_path, sizeof(dest_path), "%s", output);
+	}
+	stage_take();
+}
+
+/*
+ * Whether the name of the take is in use: in the staging directory by
+ * a take not migrated yet, or with a pattern, by an earlier take.
+ */
+static bool take_exists(void)
+{
+	char marker[PATH_MAX + sizeof(".dest")];
+
+	snprintf(marker, sizeof(marker), "%s.dest", take_path);
+	return !access(take_path, F_OK) || (staging && !access(marker, F_OK)) ||
+		(rotate && !access(dest_path, F_OK));
+}
+
+/*
+ * Opens a new file for the take.  When its name is in use, e.g. by the
+ * last take when the pattern has whole seconds, -2, -3, ... is added
+ * before the extension until it is not.  Returns a descriptor or -1.
+ */
+static int open_unique_take(void)
+{
+	char base[PATH_MAX];
+	const char *ext, *slash;
+	int fd;
+
+	snprintf(base, sizeof(base), "%s", dest_path);
+	ext = strrchr(base, '.');
+	slash = strrchr(base, '/');
+	if (!ext || (slash && ext < slash))
+		ext = base + strlen(base);
+	for (int n = 2; ; n++) {
+		if (!take_exists()) {
+			fd = open(take_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+			if (fd >= 0 && n > 2)
+				fprintf(stderr, "%s is taken, recording to %s\n",
+					base, dest_path);
+			if (fd >= 0 || errno != EEXIST)
+				return fd;
+		}
+		if (snprintf(dest_path, sizeof(dest_path), "%.*s-%d%s",
+			     (int)(ext - base), base, n, ext) >= (int)sizeof(dest_path))
+			fatal("%s is taken, and a longer name is too long", base);
+		stage_take();
+	}
+}
+
+/*
+ * With --control and a pattern, the take is opened when armed, under a
+ * hidden name in its directory, and named when it is started.
+ */
+static void name_armed_take(void)
+{
+	char *slash;
+
+	name_take();
+	slash = strrchr(take_path, '/');
+	snprintf(slash ? slash + 1 : take_path,
+		 sizeof(take_path) - (slash ? slash + 1 - take_path : 0),
+		 ".armed-%d", (int)getpid());
+}
+
+/*
+ * Opens the next take.  With a pattern as output, its name is the
+ * pattern expanded now; with --staging, it is written into the staging
+ * directory and migrated when finished.
+ */
+static void start_take(void)
+{
+	bool armed = control && rotate && !recording;
+	int fd, err;
+
+	ALLOC_ALLOW();
+	if (armed)
+		name_armed_take();
+	else
+		name_take();
+	/* a fixed name is written over, unless a staged take still has it */
+	if (!armed && (rotate || staging)) {
+		fd = open_unique_take();
+		file = fd < 0 ? NULL : fdopen(fd, "wb");
+	} else {
+		file = fopen(take_path, "wb");
+	}
+	if (!file)
+		fatal("Cannot open %s - %s", take_path, strerror(errno));
+	if (staging && !armed) {
+		err = migrate_begin(take_path, dest_path);
+		if (err < 0)
+			fatal("Cannot stage %s - %s", take_path, strerror(-err));
+	}
+#ifndef SMALL_FOOTPRINT
+	/*
+	 * Room for a full queue and its SysEx data, so that neither
+	 * recording nor emergency_finish() needs more memory.
+	 */
+	if (block_size < queue_size * 16 + (int)sysex_arena_size) {
+		block_size = queue_size * 16 + (int)sysex_arena_size;
+		block = realloc(block, block_size);
+		if (!block)
+			fatal("Out of memory");
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (compress) {
+		err = zseek_writer_init(&zseek, file, zstd_level, block_size);
+		if (err < 0)
+			fatal("Cannot set up compression - %s", strerror(-err));
+	}
+#endif
+
+	track.size = 0;
+	track.last_tick = 0;
+	track.last_command = 0;
+	block_len = 0;
+	reserved = 0;
+	disk_full = false;
+	lost_events = 0;
+	memset(&stats, 0, sizeof(stats));
+	memset(&flush_stats, 0, sizeof(flush_stats));
+	memset(&expected, 0, sizeof(expected));
+	expected.hash = FNV_OFFSET;
+
+	err = reserve_space(0);
+	if (err < 0)
+		fprintf(stderr, "Cannot allocate space for %s - %s\n", take_path,
+			strerror(-err));
+	write_header();
+	if (seek_index)
+		open_seek_index(take_path);
+	if (columns)
+		open_columns(take_path);
+	if (note_index)
+		open_note_index(take_path);
+	write_tempo();
+	file_fd = fileno(file);
+	take_open = true;
+	ALLOC_FORBID();
+}
+
+/* closes the files of the current take */
+static void close_take(void)
+{
+	file_fd = -1;
+	fclose(file);
+	file = NULL;
+#ifdef HAVE_ZSTD
+	if (compress)
+		zseek_writer_free(&zseek);
+#endif
+	if (seek_file) {
+		fclose(seek_file);
+		seek_file = NULL;
+	}
+	if (cols_file) {
+		fclose(cols_file);
+		cols_file = NULL;
+	}
+	if (note_index && notes_file)
+		close_note_index();
+}
+
+/* the finisher thread and its queue of closed takes */
+static pthread_t finisher;
+static bool finisher_started;
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+static struct finished_take *finished_head, **finished_tail = &finished_head;
+static bool finisher_stop;
+#ifdef SMALL_FOOTPRINT
+/* nothing is allocated for a take: one slot, the next take waits for it */
+static struct finished_take finished_slot;
+static bool finished_slot_used;
+#endif
+
+static struct finished_take *new_finished(void)
+{
+#ifdef SMALL_FOOTPRINT
+	pthread_mutex_lock(&finished_lock);
+	while (finished_slot_used)
+		pthread_cond_wait(&finished_cond, &finished_lock);
+	finished_slot_used = true;
+	pthread_mutex_unlock(&finished_lock);
+	return &finished_slot;
+#else
+	struct finished_take *t = malloc(sizeof(*t));
+
+	if (!t)
+		fatal("Out of memory");
+	return t;
+#endif
+}
+
+static void free_finished(struct finished_take *t)
+{
+#ifdef SMALL_FOOTPRINT
+	(void)t;
+	pthread_mutex_lock(&finished_lock);
+	finished_slot_used = false;
+	pthread_cond_broadcast(&finished_cond);
+	pthread_mutex_unlock(&finished_lock);
+#else
+	free(t);
+#endif
+}
+
+/*
+ * --staging: called on the migration thread when a take has arrived at
+ * 'dest', or with NULL when it stays staged.  Only then does the take
+ * count towards the quota, so that it is never picked while it is still
+ * being moved.  't' is NULL for a take left by a previous run.
+ */
+static void take_landed(const char *dest, void *arg)
+{
+	struct finished_take *t = arg;
+
+	if (dest && retain) {
+		if (t)
+			retention_add(dest, retention_measure(dest),
+				      t->duration_us / 1000, t->stats.notes);
+		else
+			retention_add_summary(dest);
+	}
+	if (t)
+		free_finished(t);
+}
+
+/* writes the sidecars of a closed take, checks it and hands it over */
+static void hand_over(struct finished_take *t)
+{
+	if (summary)
+		write_summary(t);
+	if (catalog)
+		add_to_catalog(t);
+	if (verify && verify_file(t))
+		verify_failed = true;
+	if (staging) {
+		migrate_take(t->take_path, t);
+		return;
+	}
+	if (retain)
+		retention_add(t->dest_path, retention_measure(t->take_path),
+			      t->duration_us / 1000, t->stats.notes);
+	free_finished(t);
+}
+
+static void *finisher_thread(void *arg)
+{
+	struct finished_take *t;
+
+	(void)arg;
+	pthread_mutex_lock(&finished_lock);
+	for (;;) {
+		while (!finished_head && !finisher_stop)
+			pthread_cond_wait(&finished_cond, &finished_lock);
+		t = finished_head;
+		if (!t)
+			break;
+		finished_head = t->next;
+		if (!finished_head)
+			finished_tail = &finished_head;
+		pthread_mutex_unlock(&finished_lock);
+		hand_over(t);
+		pthread_mutex_lock(&finished_lock);
+	}
+	pthread_mutex_unlock(&finished_lock);
+	return NULL;
+}
+
+/* queues a closed take for the finisher thread, started with the first */
+static void queue_finished(struct finished_take *t)
+{
+	int err;
+
+	if (!finisher_started) {
+		err = pthread_create(&finisher, NULL, finisher_thread, NULL);
+		if (err)
+			fatal("Cannot start a thread - %s", strerror(err));
+		finisher_started = true;
+	}
+	t->next = NULL;
+	pthread_mutex_lock(&finished_lock);
+	*finished_tail = t;
+	finished_tail = &t->next;
+	pthread_cond_broadcast(&finished_cond);
+	pthread_mutex_unlock(&finished_lock);
+}
+
+/* hands over the last takes and ends the finisher thread */
+static void stop_finisher(void)
+{
+	if (!finisher_started)
+		return;
+	pthread_mutex_lock(&finished_lock);
+	finisher_stop = true;
+	pthread_cond_broadcast(&finished_cond);
+	pthread_mutex_unlock(&finished_lock);
+	pthread_join(finisher, NULL);
+	finisher_started = false;
+	finisher_stop = false;
+}
+
+/* writes the end of the current take, and queues it to be handed over */
+static void finish_take(void)
+{
+	struct finished_take *t;
+	struct stat st;
+
+	ALLOC_ALLOW();
+	flush_buffer(true);
+	if (disk_full) {
+		/* the file keeps the end of track of its last good flush */
+		fprintf(stderr, "%s is truncated: %d bytes and %lu events could not be written\n",
+			take_path, block_len, lost_events);
+	} else {
+		int extra_size = write_track_end();
+		update_length(extra_size);
+		/* an end of track written by an earlier flush may be longer */
+#ifdef HAVE_ZSTD
+		if (!compress)
+#endif
+		if (ftruncate(fileno(file), output_end() + extra_size) < 0)
+			fprintf(stderr, "Cannot truncate %s - %s\n", take_path,
+				strerror(errno));
+#ifdef SMALL_FOOTPRINT
+		if (lost_events)
+			fprintf(stderr, "%s: %lu SysEx messages longer than %d bytes were dropped\n",
+				take_path, lost_events, SYSEX_ARENA_SIZE);
+#endif
+	}
+
+	/* give back the space allocated ahead */
+	if (fstat(fileno(file), &st) == 0 && st.st_size < reserved)
+		ftruncate(fileno(file), st.st_size);
+	close_take();
+	if (summary || catalog || verify || staging || retain) {
+		t = new_finished();
+		snprintf(t->take_path, sizeof(t->take_path), "%s", take_path);
+		snprintf(t->dest_path, sizeof(t->dest_path), "%s", dest_path);
+		t->start_us = start_time + (unsigned long long)ticks_to_us(t_start);
+		t->end_tick = end_tick;
+		t->duration_us = ticks_to_us(end_tick);
+		t->stats = stats;
+		t->flush_stats = flush_stats;
+		t->flow = flow;
+		t->expected = expected;
+		queue_finished(t);
+	}
+
+	/* the next take starts at its first event */
+	t_start = 0;
+	take_open = false;
+	ALLOC_FORBID();
+}
+
+static void sighandler(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/*
+ * --replay: the events of a standard MIDI file instead of a port, on a
+ * virtual clock that can run much faster than real time.  The file is
+ * played again and again, each pass after the previous one, until the
+ * virtual time reaches --replay-duration, so that weeks of recording
+ * can be checked in minutes.  For each virtual day, the recorder's CPU
+ * time per event, its resident memory and its open files are reported.
+ */
+static struct {
+	snd_seq_event_t *events;	/* ticks from the start of the file */
+	size_t count;
+	unsigned char *sysex;		/* the SysEx data, with its F0 */
+	uint64_t length;		/* of one pass, in queue ticks */
+} source;
+
+static void load_replay(const char *filename)
+{
+	snd_seq_queue_tempo_t *tempo;
+	struct smf_header header;
+	struct smf_decoder d;
+	struct smf_event e;
+	unsigned char *buf;
+	size_t alloc = 0, sysex_len = 0, sysex_size = 0;
+	double scale = 1;
+	long len;
+	FILE *f;
+	int err;
+
+	/* the virtual queue runs at the tempo a real one would have */
+	snd_seq_queue_tempo_alloca(&tempo);
+	set_timing(tempo);
+	queue_tempo = snd_seq_queue_tempo_get_tempo(tempo);
+	queue_ppq = snd_seq_queue_tempo_get_ppq(tempo);
+	set_latency_ticks();
+
+	f = fopen(filename, "rb");
+	if (!f)
+		fatal("Cannot open %s - %s", filename, strerror(errno));
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		fatal("Out of memory");
+	if (fread(buf, 1, len, f) != (size_t)len)
+		fatal("Cannot read %s", filename);
+	fclose(f);
+
+	err = smf_read_header(buf, len, &header);
+	if (err != SMF_EVENT)
+		fatal("Cannot replay %s - %s", filename, smf_strerror(err));
+	/* tick for tick, scaled if both resolutions are in ticks per beat */
+	if (!smpte_timing && !(header.division & 0x8000))
+		scale = (double)ticks / header.division;
+
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, buf + header.track_offset, 0,
+			     header.track_length);
+	while (smf_decode_event(&d, &e) == SMF_EVENT) {
+		snd_seq_event_t *ev;
+
+		source.length = e.tick * scale;
+		if (e.status == 0xff || (e.status == 0xf7 && !e.length))
+			continue;
+		if (source.count == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			source.events = realloc(source.events,
+						alloc * sizeof(*source.events));
+			if (!source.events)
+				fatal("Out of memory");
+		}
+		ev = &source.events[source.count++];
+		memset(ev, 0, sizeof(*ev));
+		ev->flags = SND_SEQ_TIME_STAMP_TICK;
+		ev->queue = queue;
+		ev->time.tick = e.tick * scale;
+		ev->data.note.channel = e.status & 0xf;
+		ev->data.note.note = e.data[0];
+		ev->data.note.velocity = e.data[1];
+		ev->data.control.channel = e.status & 0xf;
+		ev->data.control.param = e.data[0];
+		ev->data.control.value = e.data[1];
+		switch (e.status & 0xf0) {
+		case 0x80:
+			ev->type = SND_SEQ_EVENT_NOTEOFF;
+			break;
+		case 0x90:
+			ev->type = SND_SEQ_EVENT_NOTEON;
+			break;
+		case 0xa0:
+			ev->type = SND_SEQ_EVENT_KEYPRESS;
+			break;
+		case 0xb0:
+			ev->type = SND_SEQ_EVENT_CONTROLLER;
+			break;
+		case 0xc0:
+			ev->type = SND_SEQ_EVENT_PGMCHANGE;
+			ev->data.control.value = e.data[0];
+			break;
+		case 0xd0:
+			ev->type = SND_SEQ_EVENT_CHANPRESS;
+			ev->data.control.value = e.data[0];
+			break;
+		case 0xe0:
+			ev->type = SND_SEQ_EVENT_PITCHBEND;
+			ev->data.control.value = (e.data[0] | e.data[1] << 7) - 8192;
+			break;
+		default:
+			if (sysex_len + e.length + 1 > sysex_size) {
+				sysex_size = (sysex_len + e.length + 1) * 2;
+				source.sysex = realloc(source.sysex, sysex_size);
+				if (!source.sysex)
+					fatal("Out of memory");
+			}
+			/* an offset until the data stops moving */
+			ev->type = SND_SEQ_EVENT_SYSEX;
+			ev->data.ext.ptr = (void *)sysex_len;
+			ev->data.ext.len = e.length + (e.status == 0xf0);
+			if (e.status == 0xf0)
+				source.sysex[sysex_len++] = 0xf0;
+			memcpy(source.sysex + sysex_len, e.payload, e.length);
+			sysex_len += e.length;
+			break;
+		}
+	}
+	for (size_t i = 0; i < source.count; i++)
+		if (source.events[i].type == SND_SEQ_EVENT_SYSEX)
+			source.events[i].data.ext.ptr = source.sysex +
+				(size_t)source.events[i].data.ext.ptr;
+	free(buf);
+	if (!source.count)
+		fatal("No events to replay in %s", filename);
+}
+
+static unsigned long long thread_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* one line of the soak report */
+static void replay_report(double day, unsigned long long events,
+			  unsigned long long cpu_ns)
+{
+	long pages = 0;
+	int fds = -1;
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	dir = opendir("/proc/self/fd");
+	if (dir) {
+		/* not counting the directory itself */
+		for (fds = -1; (de = readdir(dir)); )
+			if (de->d_name[0] != '.')
+				fds++;
+		closedir(dir);
+	}
+	fprintf(stderr, "Replay: day %.1f, %llu events, %.0f ns/event, RSS %ld KiB, %d fds\n",
+		day, events, events ? (double)cpu_ns / events : 0,
+		pages * (sysconf(_SC_PAGESIZE) / 1024), fds);
+}
+
+static void replay_events(void)
+{
+	uint64_t end = us_to_ticks(replay_duration * 1e6);
+	uint64_t day = us_to_ticks(86400e6), next_report = day;
+	uint64_t timeout_ticks = us_to_ticks(timeout * 1000.0);
+	uint64_t offset, vt, last = 0;
+	unsigned long long events = 0, period_events = 0;
+	unsigned long long real_start = now_ns(), cpu = thread_ns();
+
+	start_time = realtime_us();
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	catch_crashes();
+
+	ALLOC_FORBID();
+	for (offset = 0; !stop; offset += source.length ? source.length : 1) {
+		if (offset && !replay_duration)
+			break;
+		for (size_t i = 0; i < source.count && !stop; i++) {
+			snd_seq_event_t ev = source.events[i];
+
+			/* from tick 1: a first event at tick 0 looks like none */
+			vt = 1 + offset + ev.time.tick;
+			if (replay_duration && vt > end) {
+				stop = 1;
+				break;
+			}
+			while (vt >= next_report) {
+				unsigned long long now = thread_ns();
+
+				/* reading /proc allocates */
+				ALLOC_ALLOW();
+				replay_report((double)next_report / day, period_events,
+					      now - cpu);
+				ALLOC_FORBID();
+				cpu = now;
+				period_events = 0;
+				next_report += day;
+			}
+			/* what the poll() timeout does in real time */
+			if (timeout && events && vt - last >= timeout_ticks) {
+				replay_tick = last + timeout_ticks;
+				if (!rotate) {
+					stop = 1;
+					break;
+				}
+				if (take_open)
+					finish_take();
+			}
+			if (replay_speed > 0) {
+				unsigned long long due = ticks_to_us(vt - 1) * 1000 /
+					replay_speed;
+				unsigned long long now = now_ns() - real_start;
+
+				if (due > now + 1000000) {
+					struct timespec ts = {
+						(due - now) / 1000000000,
+						(due - now) % 1000000000
+					};
+					nanosleep(&ts, NULL);
+				}
+			}
+			replay_tick = vt;
+			flush_due();
+			ev.time.tick = vt;
+			if (!take_open)
+				start_take();
+			record_event(&ev);
+			events++;
+			period_events++;
+			last = vt;
+		}
+	}
+	ALLOC_ALLOW();
+	fprintf(stderr, "Replay: %llu events, %.1f days of virtual time in %.1f s\n",
+		events, ticks_to_us(last) / 86400e6,
+		(now_ns() - real_start) / 1e9);
+}
+
+static void list_ports(void)
+{
+	snd_seq_client_info_t *cinfo;
+	snd_seq_port_info_t *pinfo;
+
+	snd_seq_client_info_alloca(&cinfo);
+	snd_seq_port_info_alloca(&pinfo);
+
+	puts(" Port    Client name                      Port name");
+
+	snd_seq_client_info_set_client(cinfo, -1);
+	while (snd_seq_query_next_client(seq, cinfo) >= 0) {
+		int client = snd_seq_client_info_get_client(cinfo);
+
+		if (client == SND_SEQ_CLIENT_SYSTEM)
+			continue; /* don't show system timer and announce ports */
+		snd_seq_port_info_set_client(pinfo, client);
+		snd_seq_port_info_set_port(pinfo, -1);
+		while (snd_seq_query_next_port(seq, pinfo) >= 0) {
+			/* port must understand MIDI messages */
+			if (!(snd_seq_port_info_get_type(pinfo)
+			      & SND_SEQ_PORT_TYPE_MIDI_GENERIC))
+				continue;
+			/* we need both READ and SUBS_READ */
+			if ((snd_seq_port_info_get_capability(pinfo)
+			     & (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ))
+			    != (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ))
+				continue;
+			printf("%3d:%-3d  %-32.32s %s\n",
 			       snd_seq_port_info_get_client(pinfo),
 			       snd_seq_port_info_get_port(pinfo),
 			       snd_seq_client_info_get_name(cinfo),
@@ -557,35 +3155,868 @@ static void list_ports(void)
 	}
 }
 
-static void help(const char *argv0)
+/*
+ * Loopback self-test: a second port of our own schedules a known
+ * pattern of events on the recording queue and is connected to the
+ * recording port, so the timestamps we receive can be compared with
+ * the ticks the events were scheduled for, and the queue's idea of
+ * time with the monotonic clock.
+ *
+ * With --loopback, the pattern goes out to that port as notes, through
+ * a cable, and back in from the -p port: the tick error is then the
+ * round-trip latency of the interface, and a --latency entry for the
+ * port is printed.
+ */
+
+#define SELF_TEST_PORT 1
+#define SELF_TEST_AHEAD 32	/* events scheduled but not yet received */
+
+/* with --loopback: the tick each note was scheduled for, by note number */
+static snd_seq_tick_time_t loopback_ticks[128];
+
+struct error_stats {
+	long n;
+	double min, max, sum, sum2;
+	unsigned long hist[24];	/* log2 buckets of |error| */
+};
+
+static void error_stats_add(struct error_stats *s, double v)
+{
+	double a = v < 0 ? -v : v;
+	int b = 0;
+
+	if (!s->n || v < s->min)
+		s->min = v;
+	if (!s->n || v > s->max)
+		s->max = v;
+	s->n++;
+	s->sum += v;
+	s->sum2 += v * v;
+	while (a >= 1 && b < 23) {
+		a /= 2;
+		b++;
+	}
+	s->hist[b]++;
+}
+
+static void error_stats_print(const char *name, const char *unit,
+			      const struct error_stats *s)
+{
+	double mean, var;
+
+	if (!s->n) {
+		printf("%s: no events\n", name);
+		return;
+	}
+	mean = s->sum / s->n;
+	var = s->sum2 / s->n - mean * mean;
+	printf("%s (%s): min %.1f  mean %.1f  max %.1f  stddev %.1f\n",
+	       name, unit, s->min, mean, s->max, var > 0 ? sqrt(var) : 0);
+	for (int b = 0; b < 24; b++) {
+		if (!s->hist[b])
+			continue;
+		printf("  |err| %s %-8lu %8lu  %5.1f%%\n",
+		       b ? "<" : "=", b ? 1UL << b : 0UL, s->hist[b],
+		       100.0 * s->hist[b] / s->n);
+	}
+}
+
+static void create_self_test_port(void)
+{
+	snd_seq_port_info_t *pinfo;
+	int err;
+
+	snd_seq_port_info_alloca(&pinfo);
+	snd_seq_port_info_set_capability(pinfo,
+					 SND_SEQ_PORT_CAP_READ |
+					 SND_SEQ_PORT_CAP_SUBS_READ);
+	snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_APPLICATION);
+	snd_seq_port_info_set_port_specified(pinfo, 1);
+	snd_seq_port_info_set_port(pinfo, SELF_TEST_PORT);
+	snd_seq_port_info_set_name(pinfo, "arecordmidi self-test");
+	err = snd_seq_create_port(seq, pinfo);
+	check_snd("create self-test port", err);
+
+	if (got_loopback) {
+		err = snd_seq_connect_to(seq, SELF_TEST_PORT, loopback.client,
+					 loopback.port);
+		check_snd("connect self-test port", err);
+		connect_port();
+		return;
+	}
+	err = snd_seq_connect_to(seq, SELF_TEST_PORT, client, 0);
+	check_snd("connect self-test port", err);
+}
+
+/* schedules one event of the test pattern, carrying its own tick */
+static void schedule_test_event(snd_seq_tick_time_t tick, unsigned int seqno)
+{
+	snd_seq_event_t ev;
+	int err;
+
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_USR0;
+	snd_seq_ev_set_source(&ev, SELF_TEST_PORT);
+	snd_seq_ev_set_subs(&ev);
+	snd_seq_ev_schedule_tick(&ev, queue, 0, tick);
+	ev.data.raw32.d[0] = tick;
+	ev.data.raw32.d[1] = seqno;
+	if (got_loopback) {
+		/* only MIDI messages pass a cable: the note number tells them apart */
+		ev.type = SND_SEQ_EVENT_NOTEON;
+		ev.data.note.channel = 15;
+		ev.data.note.note = seqno & 0x7f;
+		ev.data.note.velocity = 64;
+		loopback_ticks[seqno & 0x7f] = tick;
+	}
+	err = snd_seq_event_output(seq, &ev);
+	check_snd("schedule test event", err);
+}
+
+/* the distance to the next event: straight, triplet and dotted notes */
+static int pattern_step(unsigned int seqno)
+{
+	static const int pattern[] = { 1, 3, 4, 6, 8, 12, 16, 24, 36, 48 };
+	int step = (ticks * pattern[seqno % 10] + 24) / 48;
+
+	return step > 0 ? step : 1;
+}
+
+static int self_test(int seconds)
+{
+	struct error_stats tick_err = { }, time_err = { }, minute_err = { };
+	snd_seq_tick_time_t next_tick, first_tick = 0;
+	unsigned long long first_ns = 0, end_ns;
+	unsigned int sent = 0, received = 0;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	int minute = 1;
+	struct pollfd *pfds;
+	int npfds, err;
+
+	create_queue();
+	create_port();
+	create_self_test_port();
+
+	printf("Self-test: %d s, %s %d, %d ticks per %s (%u us / %d ticks)\n",
+	       seconds, smpte_timing ? "fps" : "bpm",
+	       smpte_timing ? frames : beats, ticks,
+	       smpte_timing ? "frame" : "beat", queue_tempo, queue_ppq);
+
+	next_tick = ticks;
+	for (; sent < SELF_TEST_AHEAD; sent++) {
+		schedule_test_event(next_tick, sent);
+		next_tick += pattern_step(sent);
+	}
+	err = snd_seq_start_queue(seq, queue, NULL);
+	check_snd("start queue", err);
+	snd_seq_drain_output(seq);
+	err = snd_seq_nonblock(seq, 1);
+	check_snd("set nonblock mode", err);
+
+	end_ns = now_ns() + seconds * 1000000000ULL;
+	npfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+	pfds = alloca(sizeof(*pfds) * npfds);
+	while (!stop && now_ns() < end_ns) {
+		snd_seq_poll_descriptors(seq, pfds, npfds, POLLIN);
+		if (poll(pfds, npfds, 1000) < 0)
+			break;
+		do {
+			snd_seq_event_t *event;
+			unsigned long long ns;
+			snd_seq_tick_time_t tick;
+			double elapsed, err_us;
+
+			err = snd_seq_event_input(seq, &event);
+			if (err < 0)
+				break;
+			if (!event)
+				continue;
+			if (got_loopback) {
+				if (event->type != SND_SEQ_EVENT_NOTEON ||
+				    event->data.note.channel != 15 ||
+				    !event->data.note.velocity)
+					continue;
+				tick = loopback_ticks[event->data.note.note & 0x7f];
+			} else {
+				if (event->type != SND_SEQ_EVENT_USR0 ||
+				    event->source.client != client)
+					continue;
+				tick = event->data.raw32.d[0];
+			}
+			ns = now_ns();
+			if (!received++) {
+				first_ns = ns;
+				first_tick = tick;
+			}
+			error_stats_add(&tick_err, (double)(int)(event->time.tick - tick));
+
+			/* wall clock against queue time, relative to the first event */
+			elapsed = (ns - first_ns) / 1000.0;
+			err_us = elapsed - ticks_to_us(tick - first_tick);
+			error_stats_add(&time_err, err_us);
+			error_stats_add(&minute_err, err_us);
+			sx += elapsed / 1e6;
+			sy += err_us;
+			sxx += elapsed / 1e6 * elapsed / 1e6;
+			sxy += elapsed / 1e6 * err_us;
+			if (elapsed >= minute * 60e6) {
+				printf("minute %d: %ld events, time error mean %.1f us, range %.1f..%.1f us\n",
+				       minute, minute_err.n, minute_err.sum / minute_err.n,
+				       minute_err.min, minute_err.max);
+				memset(&minute_err, 0, sizeof(minute_err));
+				minute++;
+			}
+
+			schedule_test_event(next_tick, sent);
+			next_tick += pattern_step(sent);
+			sent++;
+		} while (err > 0);
+		snd_seq_drain_output(seq);
+	}
+
+	printf("%u events received, %u lost\n", received,
+	       sent - received > SELF_TEST_AHEAD ?
+	       sent - received - SELF_TEST_AHEAD : 0);
+	error_stats_print("Tick error", "ticks", &tick_err);
+	error_stats_print("Time error", "us", &time_err);
+	if (time_err.n > 1 && sxx * time_err.n != sx * sx)
+		printf("Drift: %.2f ppm\n",
+		       (time_err.n * sxy - sx * sy) / (time_err.n * sxx - sx * sx));
+	if (got_loopback && tick_err.n)
+		printf("Round trip: %.2f ms\n"
+		       "For a --latency file (the round trip includes the output side):\n"
+		       "%d:%d %.2f\n",
+		       ticks_to_us(tick_err.sum / tick_err.n) / 1000,
+		       port.client, port.port,
+		       ticks_to_us(tick_err.sum / tick_err.n) / 1000);
+	snd_seq_close(seq);
+	return 0;
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] outputfile\n"
+		"\nAvailable options:\n"
+		"  -h,--help                  this help\n"
+		"  -V,--version               show version\n"
+		"  -l,--list                  list input ports\n"
+		"  -p,--port=client:port,...  source port(s)\n"
+		"  --rawmidi=device           record a raw MIDI device (e.g. hw:1,0,0) instead,\n"
+		"                             timestamped by the kernel\n"
+		"  -b,--bpm=beats             tempo in beats per minute\n"
+		"  -f,--fps=frames            resolution in frames per second (SMPTE)\n"
+		"  -t,--ticks=ticks           resolution in ticks per beat or frame\n"
+		"  -s,--split-channels        create a track for each channel\n"
+		"  -i,--timesig=nn:dd         time signature\n"
+		"  -T,--timeout=n             stop recording n milliseconds after the last event\n"
+		"  --summary                  write statistics of the take to <file>.summary\n"
+#ifndef SMALL_FOOTPRINT
+		"  --self-test[=seconds]      measure timing accuracy through a loopback port\n"
+		"  --verify                   decode the file when done and check it\n"
+		"  --catalog=file             append the take to a catalog (see smfcatalog)\n"
+		"  --seek-index               write <file>.seek for smfextract\n"
+		"  --columns                  write the messages to <file>.cols, by column (see smfcols)\n"
+		"  --notes                    write the notes to <file>.notes, with start and end (see smfnotes)\n"
+		"  --zstd[=level]             write a seekable zstd-compressed file\n"
+		"  --ump                      record MIDI 2.0 messages into a MIDI Clip File\n"
+#endif
+		"  --max-risk=ms              write each event at most ms after it arrived\n"
+		"  --max-flush-rate=n         adapt the events per flush to at most n flushes a second\n"
+		"  --latency=port=ms,...      take each source's input latency off its events;\n"
+		"  --latency=file             or from a file of \"port ms\" lines\n"
+#ifndef SMALL_FOOTPRINT
+		"  --loopback=client:port     self-test through a cable from this port to -p\n"
+#endif
+		"  --control=socket           wait armed for start, stop, rotate, mark and status\n"
+		"                             commands on a Unix socket\n"
+#ifndef SMALL_FOOTPRINT
+		"  --staging=dir              record into dir, then move takes in the background\n"
+		"  --migrate-rate=KiB/s       limit the bandwidth of moving takes\n"
+		"  --quota=size               delete takes when the directory holds more (e.g. 20G)\n"
+		"  --max-age=age              delete takes older than this (e.g. 30d, 12h)\n"
+		"  --retention-order=order    delete the oldest or the shortest takes first\n"
+#endif
+		"  --replay=file              record the events of a MIDI file on a virtual clock\n"
+		"  --replay-speed=x           run the virtual clock x times faster (default: no waits)\n"
+		"  --replay-duration=age      replay the file over and over for this long (e.g. 30d)\n"
+		"\nWith a strftime() pattern as outputfile, such as take-%%Y%%m%%d-%%H%%M%%S.mid,\n"
+		"each pause of --timeout ends a take and the next event starts a new one,\n"
+		"or --control commands start and stop takes.\n",
+		argv0);
+}
+
+#ifdef SMALL_FOOTPRINT
+/* the buffers budget.h sizes, all of them static in this build */
+#define BUFFERS_SIZE (sizeof(track) + sizeof(block) + sizeof(sysex_arenas) + \
+		      sizeof(latency))
+_Static_assert(BUFFERS_SIZE <= FOOTPRINT_MAX, "the buffers exceed FOOTPRINT_MAX");
+#endif
+
+static void version(void)
+{
+	fputs("arecordmidi version " SND_UTIL_VERSION_STR "\n", stderr);
+#ifdef SMALL_FOOTPRINT
+	fprintf(stderr, "small-footprint build: %zu KiB of buffers, %d KiB budget\n",
+		BUFFERS_SIZE >> 10, FOOTPRINT_MAX >> 10);
+#endif
+}
+
+/*
+ * --control: an armed recorder.  The sequencer, the queue and the
+ * connections are set up at startup, and the next take is opened ahead
+ * of its start, so "start" only has to read the queue time.  Events
+ * that arrive while stopped are read and dropped.
+ */
+
+/* the sidecars a take has open while it is recorded */
+static const char *const open_sidecars[] = { ".seek", ".cols", ".notes" };
+
+/*
+ * Whether a take started now would get the name of an existing one,
+ * e.g. of the last take when the pattern has whole seconds.
+ */
+static bool name_taken(void)
+{
+	char old_take[PATH_MAX], old_dest[PATH_MAX];
+	bool taken;
+
+	ALLOC_ALLOW();	/* localtime() may load the time zone */
+	snprintf(old_take, sizeof(old_take), "%s", take_path);
+	snprintf(old_dest, sizeof(old_dest), "%s", dest_path);
+	name_take();
+	taken = !access(take_path, F_OK) || !access(dest_path, F_OK);
+	snprintf(take_path, sizeof(take_path), "%s", old_take);
+	snprintf(dest_path, sizeof(dest_path), "%s", old_dest);
+	ALLOC_FORBID();
+	return taken;
+}
+
+/* gives the armed take the name of the time it is started */
+static int rename_take(void)
+{
+	char armed[PATH_MAX], from[PATH_MAX + 8], to[PATH_MAX + 8];
+	int err;
+
+	snprintf(armed, sizeof(armed), "%s", take_path);
+	name_take();
+	if (rename(armed, take_path) < 0) {
+		err = -errno;
+		snprintf(take_path, sizeof(take_path), "%s", armed);
+		return err;
+	}
+	for (size_t i = 0; i < sizeof(open_sidecars) / sizeof(*open_sidecars); i++) {
+		snprintf(from, sizeof(from), "%s%s", armed, open_sidecars[i]);
+		snprintf(to, sizeof(to), "%s%s", take_path, open_sidecars[i]);
+		if (rename(from, to) < 0 && errno != ENOENT)
+			fprintf(stderr, "Cannot rename %s - %s\n", from, strerror(errno));
+	}
+	if (staging) {
+		err = migrate_begin(take_path, dest_path);
+		if (err < 0)
+			fatal("Cannot stage %s - %s", take_path, strerror(-err));
+	}
+	return 0;
+}
+
+/* deletes the armed take when the recorder exits without starting it */
+static void discard_take(void)
+{
+	char path[PATH_MAX + 8];
+
+	close_take();
+	unlink(take_path);
+	for (size_t i = 0; i < sizeof(open_sidecars) / sizeof(*open_sidecars); i++) {
+		snprintf(path, sizeof(path), "%s%s", take_path, open_sidecars[i]);
+		unlink(path);
+	}
+	if (staging) {
+		snprintf(path, sizeof(path), "%s.dest", take_path);
+		unlink(path);
+	}
+	take_open = false;
+}
+
+/* with --control, whether an event at 'tick' is outside a take */
+static bool dropped(snd_seq_tick_time_t tick)
+{
+	/* t_start is 0 when the take starts at its first event */
+	return control && (!recording || (t_start && (int)(tick - t_start) < 0));
+}
+
+static void control_start(void)
+{
+	int err = 0;
+
+	if (recording) {
+		control_reply("error recording %s", dest_path);
+		return;
+	}
+	/*
+	 * An armed take with a fixed name is already open under that name;
+	 * once it is finished, the name stays taken.
+	 */
+	if ((rotate || !take_open) && name_taken()) {
+		control_reply("error the take would replace an existing file");
+		return;
+	}
+	ALLOC_ALLOW();
+	if (!take_open)
+		start_take();
+	else if (rotate)
+		err = rename_take();
+	ALLOC_FORBID();
+	if (err < 0) {
+		control_reply("error cannot rename %s - %s", take_path, strerror(-err));
+		return;
+	}
+	t_start = queue_tick();
+	recording = true;
+	control_reply("ok %s", dest_path);
+}
+
+static void control_stop(void)
+{
+	char path[PATH_MAX];
+
+	if (!recording) {
+		control_reply("error stopped");
+		return;
+	}
+	snprintf(path, sizeof(path), "%s", dest_path);
+	finish_take();
+	recording = false;
+	/* a fixed name is only opened again by the next start */
+	if (rotate)
+		start_take();
+	control_reply("ok %s %.3f", path, ticks_to_us(end_tick) / 1e6);
+}
+
+static void control_rotate(void)
+{
+	snd_seq_tick_time_t tick;
+
+	if (!recording) {
+		control_reply("error stopped");
+		return;
+	}
+	if (!rotate) {
+		control_reply("error rotate needs a file name pattern");
+		return;
+	}
+	if (name_taken()) {
+		control_reply("error the take would replace an existing file");
+		return;
+	}
+	/* the next take starts where this one ends */
+	tick = queue_tick();
+	finish_take();
+	start_take();
+	t_start = tick;
+	control_reply("ok %s", dest_path);
+}
+
+static void control_mark(const char *label)
+{
+	snd_seq_event_t ev = { };
+
+	if (!recording) {
+		control_reply("error stopped");
+		return;
+	}
+	if (ump) {
+		control_reply("error marks need a standard MIDI file");
+		return;
+	}
+	ev.type = EVENT_MARKER;
+	ev.flags = SND_SEQ_TIME_STAMP_TICK | SND_SEQ_EVENT_LENGTH_VARIABLE;
+	ev.queue = queue;
+	ev.time.tick = queue_tick();
+	ev.data.ext.len = strlen(label);
+	ev.data.ext.ptr = (void *)label;
+	record_event(&ev);
+	control_reply("ok %u", ev.time.tick - t_start);
+}
+
+static void control_status(void)
+{
+	if (recording)
+		control_reply("ok recording %s %.3f %u", dest_path,
+			      ticks_to_us(queue_tick() - t_start) / 1e6, track.size);
+	else if (take_open)
+		control_reply("ok armed");
+	else
+		control_reply("ok stopped");
+}
+
+static void run_command(char *command)
+{
+	char *arg = strchr(command, ' ');
+
+	if (arg)
+		*arg++ = '\0';
+	if (!strcmp(command, "start"))
+		control_start();
+	else if (!strcmp(command, "stop"))
+		control_stop();
+	else if (!strcmp(command, "rotate"))
+		control_rotate();
+	else if (!strcmp(command, "mark"))
+		control_mark(arg ? arg : "");
+	else if (!strcmp(command, "status"))
+		control_status();
+	else if (*command)
+		control_reply("error unknown command %s", command);
+}
+
+/* an event from the input: to the current take, or a new one */
+static int input_event(const snd_seq_event_t *ev)
+{
+	if (dropped(ev->time.tick))
+		return 0;
+	if (!take_open)
+		start_take();
+	record_event(ev);
+	return 1;
+}
+
+#ifdef HAVE_RAWMIDI_TSTAMP
+/*
+ * --rawmidi: the bytes of a raw MIDI device instead of a sequencer
+ * port.  The kernel stamps them with the monotonic clock as it receives
+ * them (framing mode), and the queue time is computed from that clock
+ * at the queue tempo, so no sequencer is used at all.  The parser turns
+ * the bytes into the events the sequencer would have delivered, SysEx
+ * in chunks, and passes them to the same encoder.  Real-time and
+ * system common messages are not recorded, also inside SysEx.
+ */
+static struct {
+	unsigned char status;		/* running status, 0: none */
+	unsigned char data[2];
+	int count, needed;		/* data bytes received and needed */
+	bool fresh;			/* the status byte came with this message */
+	snd_seq_tick_time_t tick;	/* of the message's first byte */
+	bool sysex;			/* within F0 ... F7 */
+	int sysex_len;
+	snd_seq_tick_time_t sysex_tick;
+	int events;			/* recorded since the last read */
+	unsigned char sysex_data[RAWMIDI_SYSEX_CHUNK];
+} parser;
+/* each chunk is copied into the arena like the sequencer's SysEx events */
+_Static_assert(RAWMIDI_SYSEX_CHUNK <= SYSEX_ARENA_SIZE,
+	       "RAWMIDI_SYSEX_CHUNK is larger than SYSEX_ARENA_SIZE");
+
+static void open_rawmidi(void)
+{
+	snd_seq_queue_tempo_t *tempo;
+	snd_rawmidi_params_t *params;
+	int err;
+
+	err = snd_rawmidi_open(&rawmidi, NULL, rawmidi_device, SND_RAWMIDI_NONBLOCK);
+	if (err < 0)
+		fatal("Cannot open %s - %s", rawmidi_device, snd_strerror(err));
+	snd_rawmidi_params_alloca(&params);
+	err = snd_rawmidi_params_current(rawmidi, params);
+	check_snd("get raw MIDI parameters", err);
+	err = snd_rawmidi_params_set_read_mode(rawmidi, params, SND_RAWMIDI_READ_TSTAMP);
+	check_snd("set raw MIDI framing mode", err);
+	err = snd_rawmidi_params_set_clock_type(rawmidi, params, SND_RAWMIDI_CLOCK_MONOTONIC);
+	check_snd("set raw MIDI clock", err);
+	/* framing needs Linux 5.14 or later */
+	err = snd_rawmidi_params(rawmidi, params);
+	check_snd("set raw MIDI timestamps", err);
+
+	/* the queue a sequencer would have run, on the same clock */
+	snd_seq_queue_tempo_alloca(&tempo);
+	set_timing(tempo);
+	queue_tempo = snd_seq_queue_tempo_get_tempo(tempo);
+	queue_ppq = snd_seq_queue_tempo_get_ppq(tempo);
+	rawmidi_origin = now_ns();
+	start_time = realtime_us();
+}
+
+/* a SysEx event of the bytes collected so far */
+static void rawmidi_sysex(void)
+{
+	snd_seq_event_t ev = { };
+
+	if (!parser.sysex_len)
+		return;
+	ev.type = SND_SEQ_EVENT_SYSEX;
+	ev.flags = SND_SEQ_TIME_STAMP_TICK | SND_SEQ_EVENT_LENGTH_VARIABLE;
+	ev.queue = queue;
+	ev.time.tick = parser.sysex_tick;
+	ev.data.ext.len = parser.sysex_len;
+	ev.data.ext.ptr = parser.sysex_data;
+	parser.events += input_event(&ev);
+	parser.sysex_len = 0;
+}
+
+/* the event of a complete channel message */
+static void rawmidi_message(void)
+{
+	unsigned char status = parser.status;
+	snd_seq_event_t ev = { };
+
+	ev.flags = SND_SEQ_TIME_STAMP_TICK;
+	ev.queue = queue;
+	ev.time.tick = parser.tick;
+	switch (status & 0xf0) {
+	case 0x80:
+	case 0x90:
+	case 0xa0:
+		ev.type = (status & 0xf0) == 0x80 ? SND_SEQ_EVENT_NOTEOFF :
+			(status & 0xf0) == 0x90 ? SND_SEQ_EVENT_NOTEON :
+			SND_SEQ_EVENT_KEYPRESS;
+		ev.data.note.channel = status & 0x0f;
+		ev.data.note.note = parser.data[0];
+		ev.data.note.velocity = parser.data[1];
+		break;
+	case 0xb0:
+		ev.type = SND_SEQ_EVENT_CONTROLLER;
+		ev.data.control.param = parser.data[0];
+		ev.data.control.value = parser.data[1];
+		break;
+	case 0xc0:
+	case 0xd0:
+		ev.type = (status & 0xf0) == 0xc0 ? SND_SEQ_EVENT_PGMCHANGE :
+			SND_SEQ_EVENT_CHANPRESS;
+		ev.data.control.value = parser.data[0];
+		break;
+	case 0xe0:
+		ev.type = SND_SEQ_EVENT_PITCHBEND;
+		ev.data.control.value = (parser.data[0] | parser.data[1] << 7) - 8192;
+		break;
+	}
+	if ((status & 0xf0) > 0xa0)
+		ev.data.control.channel = status & 0x0f;
+	parser.events += input_event(&ev);
+}
+
+static void parse_byte(unsigned char byte, snd_seq_tick_time_t tick)
+{
+	/* real time: may come anywhere, even between the bytes of SysEx */
+	if (byte >= 0xf8)
+		return;
+	if (parser.sysex) {
+		if (byte < 0x80 || byte == 0xf7) {
+			if (!parser.sysex_len)
+				parser.sysex_tick = tick;
+			parser.sysex_data[parser.sysex_len++] = byte;
+			if (byte == 0xf7)
+				parser.sysex = false;
+			if (byte == 0xf7 || parser.sysex_len == RAWMIDI_SYSEX_CHUNK)
+				rawmidi_sysex();
+			return;
+		}
+		/* another status byte ends it, unterminated */
+		rawmidi_sysex();
+		parser.sysex = false;
+	}
+	if (byte == 0xf0) {
+		parser.sysex = true;
+		parser.sysex_data[0] = byte;
+		parser.sysex_len = 1;
+		parser.sysex_tick = tick;
+		parser.status = 0;
+		return;
+	}
+	if (byte >= 0x80) {
+		/* system common messages cancel running status */
+		parser.status = byte;
+		parser.count = 0;
+		parser.needed = byte == 0xf2 ? 2 : byte == 0xf1 || byte == 0xf3 ? 1 :
+			byte >= 0xf0 ? 0 : (byte & 0xe0) == 0xc0 ? 1 : 2;
+		parser.fresh = true;
+		parser.tick = tick;
+		if (byte >= 0xf0 && !parser.needed)
+			parser.status = 0;
+		return;
+	}
+	/* a data byte without a status is dropped */
+	if (!parser.status)
+		return;
+	if (!parser.count && !parser.fresh)
+		parser.tick = tick;	/* running status */
+	parser.fresh = false;
+	parser.data[parser.count++] = byte;
+	if (parser.count < parser.needed)
+		return;
+	parser.count = 0;
+	if (parser.status < 0xf0)
+		rawmidi_message();
+	else
+		parser.status = 0;
+}
+
+/* parses what the device has received; returns the events recorded */
+static int read_rawmidi(void)
 {
-	fprintf(stderr, "Usage: %s [options] outputfile\n"
-		"\nAvailable options:\n"
-		"  -h,--help                  this help\n"
-		"  -V,--version               show version\n"
-		"  -l,--list                  list input ports\n"
-		"  -p,--port=client:port,...  source port(s)\n"
-		"  -b,--bpm=beats             tempo in beats per minute\n"
-		"  -f,--fps=frames            resolution in frames per second (SMPTE)\n"
-		"  -t,--ticks=ticks           resolution in ticks per beat or frame\n"
-		"  -s,--split-channels        create a track for each channel\n"
-		"  -i,--timesig=nn:dd         time signature\n"
-		"  -T,--timeout=n             stop recording n milliseconds after the last event\n",
-		argv0);
+	unsigned char buf[256];
+	struct timespec ts;
+	ssize_t n;
+
+	parser.events = 0;
+	/* each read has bytes that arrived at the same time */
+	while ((n = snd_rawmidi_tread(rawmidi, &ts, buf, sizeof(buf))) > 0) {
+		snd_seq_tick_time_t tick =
+			rawmidi_tick(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+
+		for (ssize_t i = 0; i < n; i++)
+			parse_byte(buf[i], tick);
+	}
+	if (n < 0 && n != -EAGAIN)
+		fatal("Cannot read %s - %s", rawmidi_device, snd_strerror(n));
+	return parser.events;
 }
+#endif
 
-static void version(void)
+/* sets up the queue and the port, connected to the sources, and starts */
+static void open_port(void)
 {
-	fputs("arecordmidi version " SND_UTIL_VERSION_STR "\n", stderr);
+	int err;
+
+#ifdef HAVE_UMP
+	if (ump) {
+		/* MIDI 1.0 sources are converted by the sequencer */
+		err = snd_seq_set_client_midi_version(seq, SND_SEQ_CLIENT_UMP_MIDI_2_0);
+		check_snd("set MIDI 2.0 client", err);
+	}
+#endif
+	create_queue();
+	set_latency_ticks();
+	create_port();
+	connect_port();
+	
+	err = snd_seq_start_queue(seq, queue, NULL);
+	check_snd("start queue", err);
+	snd_seq_drain_output(seq);
+	start_time = realtime_us();
+
+	err = snd_seq_nonblock(seq, 1);
+	check_snd("set nonblock mode", err);
 }
 
-static void sighandler(int sig)
+/* reads what the sequencer has delivered; returns the events recorded */
+static int read_seq(void)
 {
-	stop = 1;
+	int events = 0;
+	int err;
+
+	do {
+		snd_seq_event_t *event;
+#ifdef HAVE_UMP
+		if (ump) {
+			snd_seq_ump_event_t *ump_event;
+
+			err = snd_seq_ump_event_input(seq, &ump_event);
+			if (err < 0)
+				break;
+			/* only UMP events: not port or client announcements */
+			if (ump_event && snd_seq_ev_is_ump(ump_event) &&
+			    !dropped(ump_event->time.tick)) {
+				if (!take_open)
+					start_take();
+				record_ump_event(ump_event);
+				events++;
+			}
+			continue;
+		}
+#endif
+		err = snd_seq_event_input(seq, &event);
+		if (err < 0)
+			break;
+		if (event)
+			events += input_event(event);
+	} while (err > 0);
+	return events;
+}
+
+/* records from the port, or the raw MIDI device, until stopped */
+static void record_port(void)
+{
+	struct pollfd *pfds;
+	int npfds, poll_ms;
+	int err;
+	int no_events = 0;
+	unsigned long long idle_start = now_ns();
+
+#ifdef HAVE_RAWMIDI_TSTAMP
+	if (rawmidi_device) {
+		open_rawmidi();
+		npfds = snd_rawmidi_poll_descriptors_count(rawmidi);
+	} else
+#endif
+	{
+		open_port();
+		npfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	catch_crashes();
+
+	pfds = alloca(sizeof(*pfds) * (npfds + CONTROL_POLL_FDS));
+	ALLOC_FORBID();
+	for (;;) {
+#ifdef HAVE_RAWMIDI_TSTAMP
+		if (rawmidi)
+			snd_rawmidi_poll_descriptors(rawmidi, pfds, npfds);
+		else
+#endif
+			snd_seq_poll_descriptors(seq, pfds, npfds, POLLIN);
+		if (control)
+			control_poll_descriptors(pfds + npfds);
+		poll_ms = flush_wait();
+		if (timeout) {
+			/* poll() may return early for --max-risk */
+			long long left = timeout - (long long)(now_ns() - idle_start) / 1000000;
+
+			if (poll_ms < 0 || left < poll_ms)
+				poll_ms = left > 0 ? left : 0;
+		}
+		err = poll(pfds, npfds + (control ? CONTROL_POLL_FDS : 0), poll_ms);
+		if (err == 0) {
+			if (timeout && now_ns() - idle_start >= timeout * 1000000ULL) {
+				// timeout occured
+				if (no_events>0 && !rotate)
+					break;
+				if (take_open && rotate)
+					finish_take();
+				idle_start = now_ns();
+			}
+		} else if (err < 0) {
+			break;
+		} else {
+			idle_start = now_ns();
+		}
+#ifdef HAVE_RAWMIDI_TSTAMP
+		if (rawmidi)
+			no_events += read_rawmidi();
+		else
+#endif
+			no_events += read_seq();
+		/* after the events, so that a take has those that came before */
+		if (control) {
+			char *command;
+
+			while ((command = control_command(pfds + npfds)))
+				run_command(command);
+		}
+		flush_due();
+		if (stop)
+			break;
+	}
+	ALLOC_ALLOW();
 }
 
 int main(int argc, char *argv[])
 {
+	enum { OPT_SELF_TEST = 0x100, OPT_VERIFY, OPT_SUMMARY,
+	       OPT_CATALOG, OPT_SEEK_INDEX, OPT_ZSTD, OPT_STAGING,
+	       OPT_MIGRATE_RATE, OPT_QUOTA, OPT_MAX_AGE, OPT_RETENTION_ORDER,
+	       OPT_REPLAY, OPT_REPLAY_SPEED, OPT_REPLAY_DURATION, OPT_UMP,
+	       OPT_LATENCY, OPT_LOOPBACK, OPT_COLUMNS, OPT_NOTES, OPT_CONTROL,
+	       OPT_RAWMIDI, OPT_MAX_RISK, OPT_MAX_FLUSH_RATE };
 	static const char short_options[] = "hVlp:b:f:t:T:sdm:i:";
 	static const struct option long_options[] = {
 		{"help", 0, NULL, 'h'},
@@ -599,18 +4030,41 @@ int main(int argc, char *argv[])
 		{"dump", 0, NULL, 'd'},
 		{"timesig", 1, NULL, 'i'},
 		{"timeout", 1, NULL, 'T'},
+		{"summary", 0, NULL, OPT_SUMMARY},
+#ifndef SMALL_FOOTPRINT
+		{"self-test", 2, NULL, OPT_SELF_TEST},
+		{"verify", 0, NULL, OPT_VERIFY},
+		{"catalog", 1, NULL, OPT_CATALOG},
+		{"seek-index", 0, NULL, OPT_SEEK_INDEX},
+		{"columns", 0, NULL, OPT_COLUMNS},
+		{"notes", 0, NULL, OPT_NOTES},
+		{"zstd", 2, NULL, OPT_ZSTD},
+		{"staging", 1, NULL, OPT_STAGING},
+		{"migrate-rate", 1, NULL, OPT_MIGRATE_RATE},
+		{"quota", 1, NULL, OPT_QUOTA},
+		{"max-age", 1, NULL, OPT_MAX_AGE},
+		{"retention-order", 1, NULL, OPT_RETENTION_ORDER},
+#endif
+		{"replay", 1, NULL, OPT_REPLAY},
+		{"replay-speed", 1, NULL, OPT_REPLAY_SPEED},
+		{"replay-duration", 1, NULL, OPT_REPLAY_DURATION},
+		{"latency", 1, NULL, OPT_LATENCY},
+#ifndef SMALL_FOOTPRINT
+		{"ump", 0, NULL, OPT_UMP},
+		{"loopback", 1, NULL, OPT_LOOPBACK},
+#endif
+		{"control", 1, NULL, OPT_CONTROL},
+		{"rawmidi", 1, NULL, OPT_RAWMIDI},
+		{"max-risk", 1, NULL, OPT_MAX_RISK},
+		{"max-flush-rate", 1, NULL, OPT_MAX_FLUSH_RATE},
 		{ }
 	};
 
-	char *filename = NULL;
 	int do_list = 0;
-	struct pollfd *pfds;
-	int npfds;
+	int self_test_seconds = 0;
+	unsigned long migrate_rate = 0;
+	struct retention_config retention = { };
 	int c, err;
-	int no_events = 0;
-
-	init_seq();
-
 	while ((c = getopt_long(argc, argv, short_options,
 				long_options, NULL)) != -1) {
 		switch (c) {
@@ -655,6 +4109,118 @@ int main(int argc, char *argv[])
 			if (timeout < 0)
 				fatal("Timout must be 0(=disabled) or a positive value in milliseconds.");
 			break;
+		case OPT_SUMMARY:
+			summary = true;
+			break;
+#ifndef SMALL_FOOTPRINT
+		case OPT_VERIFY:
+			verify = true;
+			break;
+		case OPT_CATALOG:
+			catalog = optarg;
+			break;
+		case OPT_SEEK_INDEX:
+			seek_index = true;
+			break;
+		case OPT_COLUMNS:
+			columns = true;
+			break;
+		case OPT_NOTES:
+			note_index = true;
+			break;
+#endif
+		case OPT_ZSTD:
+#ifdef HAVE_ZSTD
+			compress = true;
+			zstd_level = optarg ? atoi(optarg) : 3;
+			queue_size = ZSTD_QUEUE_SIZE;
+			break;
+#else
+			fatal("Compressed output needs a build with -DHAVE_ZSTD");
+#endif
+		case OPT_UMP:
+#ifdef HAVE_UMP
+			ump = true;
+			break;
+#else
+			fatal("MIDI 2.0 capture needs alsa-lib 1.2.10 or later");
+#endif
+		case OPT_LATENCY:
+			parse_latency(optarg);
+			break;
+#ifndef SMALL_FOOTPRINT
+		case OPT_LOOPBACK:
+			init_seq();
+			err = snd_seq_parse_address(seq, &loopback, optarg);
+			if (err < 0)
+				fatal("Invalid port %s - %s", optarg, snd_strerror(err));
+			got_loopback = true;
+			break;
+#endif
+		case OPT_CONTROL:
+			control = optarg;
+			break;
+		case OPT_RAWMIDI:
+#ifdef HAVE_RAWMIDI_TSTAMP
+			rawmidi_device = optarg;
+			break;
+#else
+			fatal("Raw MIDI capture needs alsa-lib 1.2.6 or later");
+#endif
+		case OPT_MAX_RISK:
+			max_risk = atoi(optarg);
+			if (max_risk < 1)
+				fatal("Invalid maximum risk %s", optarg);
+			adaptive = true;
+			break;
+		case OPT_MAX_FLUSH_RATE:
+			max_flush_rate = atof(optarg);
+			if (max_flush_rate <= 0)
+				fatal("Invalid maximum flush rate %s", optarg);
+			adaptive = true;
+			break;
+#ifndef SMALL_FOOTPRINT
+		case OPT_STAGING:
+			staging = optarg;
+			break;
+		case OPT_MIGRATE_RATE:
+			migrate_rate = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case OPT_QUOTA:
+			retention.quota = parse_size(optarg);
+			retain = true;
+			break;
+		case OPT_MAX_AGE:
+			retention.max_age = parse_age(optarg);
+			retain = true;
+			break;
+		case OPT_RETENTION_ORDER:
+			if (!strcmp(optarg, "oldest"))
+				retention.order = RETENTION_OLDEST;
+			else if (!strcmp(optarg, "shortest"))
+				retention.order = RETENTION_SHORTEST;
+			else
+				fatal("Invalid retention order %s", optarg);
+			break;
+#endif
+		case OPT_REPLAY:
+			replay = optarg;
+			break;
+		case OPT_REPLAY_SPEED:
+			replay_speed = atof(optarg);
+			if (replay_speed < 0)
+				fatal("Invalid replay speed");
+			break;
+		case OPT_REPLAY_DURATION:
+			replay_duration = parse_age(optarg);
+			break;
+#ifndef SMALL_FOOTPRINT
+		case OPT_SELF_TEST:
+			self_test_seconds = optarg ? atoi(optarg) : 60;
+			if (self_test_seconds < 1)
+				fatal("Invalid self-test duration");
+			break;
+#endif
 		default:
 			help(argv[0]);
 			return 1;
@@ -662,98 +4228,109 @@ int main(int argc, char *argv[])
 	}
 
 	if (do_list) {
+		init_seq();
 		list_ports();
 		return 0;
 	}
 
-	if (!got_a_port) {
-		fputs("Pleast specify a source port with --port.\n", stderr);
-		return 1;
-	}
-
 	if (!ticks)
 		ticks = smpte_timing ? 40 : 384;
 	if (smpte_timing && ticks > 0xff)
 		ticks = 0xff;
 
+	if (self_test_seconds) {
+		if (got_loopback && !got_a_port)
+			fatal("--loopback needs the port the cable comes back to, with --port");
+		signal(SIGINT, sighandler);
+		signal(SIGTERM, sighandler);
+		init_seq();
+		return self_test(self_test_seconds);
+	}
+
+	/* these read the events and the file as MIDI 1.0 */
+	if (ump && (smpte_timing || verify || seek_index || columns || note_index ||
+		    replay))
+		fatal("--ump cannot be used with --fps, --verify, --seek-index, --columns, --notes or --replay");
+
+	/* a raw MIDI device has no sequencer ports, nor UMP */
+	if (rawmidi_device && (got_a_port || replay || ump || latency_count))
+		fatal("--rawmidi cannot be used with --port, --replay, --ump or --latency");
+
+	/* a flush by --max-risk every max_risk ms while events come in */
+	if (max_risk && max_flush_rate && 1000.0 / max_risk > max_flush_rate)
+		fatal("--max-risk=%d makes up to %.1f flushes a second, more than --max-flush-rate",
+		      max_risk, 1000.0 / max_risk);
+	size_buffers();
+
+	if (!got_a_port && !replay && !rawmidi_device) {
+		fputs("Pleast specify a source port with --port.\n", stderr);
+		return 1;
+	}
+
 	if (optind >= argc) {
 		fputs("Please specify a file to record to.\n", stderr);
 		return 1;
 	}
-	filename = argv[optind];
-	
-	file = fopen(filename, "wb");
-	if (!file)
-		fatal("Cannot open %s - %s", filename, strerror(errno));
+	output = argv[optind];
+	rotate = strchr(output, '%') != NULL;
+	if (control && (replay || timeout))
+		fatal("--control cannot be used with --replay or --timeout");
+	if (rotate && !timeout && !control)
+		fatal("A file name pattern needs --timeout or --control to end each take");
 
-	create_queue();
-	create_port();
-	connect_port();
-	
-	write_header();
+	if (retain) {
+		char dir[PATH_MAX];
+		const char *slash = strrchr(output, '/');
+		const char *suffix = strrchr(slash ? slash : output, '.');
 
-	/* record tempo */
-	if (!smpte_timing) {
-		int usecs_per_quarter = 60000000 / beats;
-		var_value(&track, 0); /* delta time */
-		add_byte(&track, 0xff);
-		add_byte(&track, 0x51);
-		var_value(&track, 3);
-		add_byte(&track, usecs_per_quarter >> 16);
-		add_byte(&track, usecs_per_quarter >> 8);
-		add_byte(&track, usecs_per_quarter);
-
-		/* time signature */
-		var_value(&track, 0); /* delta time */
-		add_byte(&track, 0xff);
-		add_byte(&track, 0x58);
-		var_value(&track, 4);
-		add_byte(&track, ts_num);
-		add_byte(&track, ts_dd);
-		add_byte(&track, 24); /* MIDI clocks per metronome click */
-		add_byte(&track, 8); /* notated 32nd-notes per MIDI quarter note */
+		snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - output) : 1,
+			 slash ? output : ".");
+		if (strchr(dir, '%') || !suffix)
+			fatal("--quota and --max-age need a fixed directory and a file name extension");
+		err = retention_start(*dir ? dir : "/", suffix, &retention);
+		if (err < 0)
+			fatal("Cannot index %s - %s", dir, strerror(-err));
 	}
-	
-	err = snd_seq_start_queue(seq, queue, NULL);
-	check_snd("start queue", err);
-	snd_seq_drain_output(seq);
-
-	err = snd_seq_nonblock(seq, 1);
-	check_snd("set nonblock mode", err);
-	
-	signal(SIGINT, sighandler);
-	signal(SIGTERM, sighandler);
-
-	npfds = snd_seq_poll_descriptors_count(seq, POLLIN);
-	pfds = alloca(sizeof(*pfds) * npfds);
-	for (;;) {
-		snd_seq_poll_descriptors(seq, pfds, npfds, POLLIN);
-		err = poll(pfds, npfds, (timeout==0) ? -1 : timeout);
-		if (err == 0) { // timeout occured
-			if (no_events>0)
-				break;
-		} else if (err < 0) {
-			break;
-		}
-		do {
-			snd_seq_event_t *event;
-			err = snd_seq_event_input(seq, &event);
-			if (err < 0)
-				break;
-			if (event) {
-				record_event(event);
-				no_events++;
-			}
-		} while (err > 0);
-		if (stop)
-			break;
+	/* after the index, which the takes left staged are added to */
+	if (staging) {
+		err = migrate_start(staging, migrate_rate, take_landed);
+		if (err < 0)
+			fatal("Cannot use staging directory %s - %s", staging,
+			      strerror(-err));
 	}
+	if (control) {
+		err = control_open(control);
+		if (err < 0)
+			fatal("Cannot listen on %s - %s", control, strerror(-err));
+	}
+	if (replay)
+		load_replay(replay);
+	/* armed: the take is opened now, and named again when started */
+	if (control && !rotate && name_taken())
+		fatal("%s exists, the armed take would replace it", output);
+	if (!rotate || control)
+		start_take();
+	if (replay)
+		replay_events();
+	else
+		record_port();
 
-	flush_buffer();
-	int extra_size = write_track_end();
-	update_length(extra_size);
-
-	fclose(file);
-	snd_seq_close(seq);
-	return 0;
+	if (take_open && control && !recording)
+		discard_take();
+	else if (take_open)
+		finish_take();
+	stop_finisher();
+	if (control)
+		control_close();
+	if (seq)
+		snd_seq_close(seq);
+#ifdef HAVE_RAWMIDI_TSTAMP
+	if (rawmidi)
+		snd_rawmidi_close(rawmidi);
+#endif
+	if (staging)
+		migrate_finish();
+	if (retain)
+		retention_finish();
+	return verify_failed;
 }
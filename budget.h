@@ -0,0 +1,74 @@
+/*
+ * budget.h - the sizes of arecordmidi's buffers, arenas and queues
+ *
+ * Every buffer the recorder keeps is sized here.  A build with
+ * -DSMALL_FOOTPRINT is for small boards where resident memory and the
+ * size of the binary matter: the buffers are smaller and all static,
+ * nothing is allocated while recording or when a take starts, and the
+ * optional subsystems (--verify, --seek-index, --columns, --notes,
+ * --catalog, --staging, --quota and --max-age, --self-test, --ump and
+ * --zstd) are left out.  FOOTPRINT_MAX is what its static data may
+ * take, and FOOTPRINT_TEXT_MAX its code; footprint.sh checks both.
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#ifdef SMALL_FOOTPRINT
+
+#ifdef HAVE_ZSTD
+#error "--zstd is not available in a small-footprint build"
+#endif
+
+#define EVENT_QUEUE_SIZE 64	/* whatever --max-flush-rate asks for */
+#define ZSTD_QUEUE_SIZE 4096	/* events per compressed frame */
+#define RESERVE_SIZE (256 << 10)	/* disk space allocated ahead of the data */
+#define RESERVE_MARGIN 4096	/* room for the end of track */
+#define SPILL_MAX (32 << 10)	/* data kept in memory while the disk is full */
+#define SEEK_INTERVAL 65536	/* track bytes between seek index points */
+#define SYSEX_ARENA_SIZE 4096	/* SysEx data of the queued events */
+#define LATENCY_MAX 8		/* sources with a --latency offset */
+#define RAWMIDI_SYSEX_CHUNK 1024	/* SysEx bytes per event with --rawmidi */
+#define PACK_BATCH 32		/* events per pack_messages() call */
+#define CRASH_STACK_SIZE 16384	/* the signal stack emergency_finish() runs on */
+#define EVENT_BYTES_MAX 96	/* encoded, with the pauses before it */
+/* the encoding buffer: the data held while the disk is full, then a queue */
+#define BLOCK_SIZE (SPILL_MAX + EVENT_QUEUE_SIZE * EVENT_BYTES_MAX + \
+		    SYSEX_ARENA_SIZE)
+#define FOOTPRINT_MAX (96 << 10)	/* data and bss */
+#define FOOTPRINT_TEXT_MAX (64 << 10)	/* code and constants */
+
+#else
+
+#define EVENT_QUEUE_SIZE 128
+#define ZSTD_QUEUE_SIZE 4096	/* events per compressed frame */
+#define RESERVE_SIZE (1 << 20)	/* disk space allocated ahead of the data */
+#define RESERVE_MARGIN 65536	/* room for the end of track or trailer */
+#define SPILL_MAX (64 << 20)	/* data kept in memory while the disk is full */
+#define SEEK_INTERVAL 65536	/* track bytes between seek index points */
+#define SYSEX_ARENA_SIZE 65536	/* SysEx data of the queued events */
+#define LATENCY_MAX 32		/* sources with a --latency offset */
+#define RAWMIDI_SYSEX_CHUNK 4096	/* SysEx bytes per event with --rawmidi */
+#define PACK_BATCH 64		/* events per pack_messages() call */
+#define CRASH_STACK_SIZE 65536	/* the signal stack emergency_finish() runs on */
+/*
+ * --max-flush-rate and --max-risk size the queue for the events that
+ * arrive at EVENT_RATE_MAX a second between two flushes, about ten
+ * MIDI 1.0 cables at full speed, and its SysEx arenas in proportion;
+ * no more than FLUSH_QUEUE_MAX events and SYSEX_ARENA_MAX bytes.
+ */
+#define EVENT_RATE_MAX 10000
+#define FLUSH_QUEUE_MAX 4096
+#define SYSEX_ARENA_MAX (2 << 20)
+
+#endif
+
+/* the most events the queue ever holds */
+#ifdef SMALL_FOOTPRINT
+#define QUEUE_MAX EVENT_QUEUE_SIZE
+#else
+#define QUEUE_MAX (FLUSH_QUEUE_MAX > ZSTD_QUEUE_SIZE ? FLUSH_QUEUE_MAX : \
+		   ZSTD_QUEUE_SIZE)
+#endif
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * catalog.c - append-only catalog of recorded takes
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "catalog.h"
+
+static const char *const note_names[12] = {
+	"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Appends one entry, creating the catalog if needed.  entry->end_us is
+ * set here, under the lock, so that it is ordered with the entries
+ * appended by other recorders.  Returns 0 or -errno.
+ */
+int catalog_append(const char *catalog, struct catalog_entry *entry)
+{
+	struct catalog_header header;
+	struct catalog_entry last;
+	struct timespec ts;
+	struct stat st;
+	int fd, err;
+
+	fd = open(catalog, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	if (st.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+		header.entry_size = sizeof(*entry);
+		err = write_all(fd, &header, sizeof(header));
+		if (err < 0) {
+			ftruncate(fd, 0);
+			goto out;
+		}
+		st.st_size = sizeof(header);
+	} else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		   memcmp(header.magic, CATALOG_MAGIC, sizeof(header.magic)) ||
+		   header.entry_size != sizeof(*entry)) {
+		err = -EINVAL;
+		goto out;
+	}
+	/* the rest of an append that was cut short, e.g. by a crash */
+	if ((st.st_size - sizeof(header)) % sizeof(*entry)) {
+		st.st_size -= (st.st_size - sizeof(header)) % sizeof(*entry);
+		if (ftruncate(fd, st.st_size) < 0) {
+			err = -errno;
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	entry->end_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	if (st.st_size > (off_t)sizeof(header) &&
+	    pread(fd, &last, sizeof(last), st.st_size - sizeof(last)) ==
+	    sizeof(last) && last.end_us > entry->end_us)
+		entry->end_us = last.end_us;	/* the clock was stepped back */
+
+	err = write_all(fd, entry, sizeof(*entry));
+	/* a part of an entry would make the catalog unreadable */
+	if (err < 0)
+		ftruncate(fd, st.st_size);
+out:
+	close(fd);
+	return err;
+}
+
+/*
+ * Estimates the key from a pitch histogram by correlating the pitch
+ * classes with the Krumhansl-Kessler key profiles.
+ */
+int catalog_estimate_key(const unsigned long *pitches)
+{
+	static const double profile[2][12] = {
+		{ 6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88 },
+		{ 6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17 },
+	};
+	double classes[12] = { }, mean = 0, best = 0;
+	unsigned long total = 0;
+	int key = CATALOG_KEY_UNKNOWN;
+
+	for (int i = 0; i < 128; i++) {
+		classes[i % 12] += pitches[i];
+		total += pitches[i];
+	}
+	if (total < 8)
+		return CATALOG_KEY_UNKNOWN;
+	for (int i = 0; i < 12; i++)
+		mean += classes[i] / 12;
+
+	for (int mode = 0; mode < 2; mode++) {
+		double pmean = 0;
+
+		for (int i = 0; i < 12; i++)
+			pmean += profile[mode][i] / 12;
+		for (int tonic = 0; tonic < 12; tonic++) {
+			double sxy = 0, sxx = 0, syy = 0, r;
+
+			for (int i = 0; i < 12; i++) {
+				double x = classes[(tonic + i) % 12] - mean;
+				double y = profile[mode][i] - pmean;
+
+				sxy += x * y;
+				sxx += x * x;
+				syy += y * y;
+			}
+			if (sxx <= 0)
+				return CATALOG_KEY_UNKNOWN;
+			/* compare r^2 with the sign kept, to avoid sqrt() */
+			r = sxy * (sxy < 0 ? -sxy : sxy) / (sxx * syy);
+			if (key == CATALOG_KEY_UNKNOWN || r > best) {
+				best = r;
+				key = mode * 12 + tonic;
+			}
+		}
+	}
+	return key;
+}
+
+const char *catalog_key_name(int key)
+{
+	static char name[16];
+
+	if (key < 0 || key >= 24)
+		return "unknown";
+	snprintf(name, sizeof(name), "%s %s", note_names[key % 12],
+		 key < 12 ? "major" : "minor");
+	return name;
+}
+
+/* parses "C minor", "Eb major", "f#m", ...; returns -1 if invalid */
+int catalog_parse_key(const char *name)
+{
+	static const int letters[7] = { 9, 11, 0, 2, 4, 5, 7 };	/* A..G */
+	int tonic;
+
+	if (strlen(name) < 1 || (name[0] | 0x20) < 'a' || (name[0] | 0x20) > 'g')
+		return -1;
+	tonic = letters[(name[0] | 0x20) - 'a'];
+	name++;
+	if (*name == '#')
+		tonic++, name++;
+	else if (*name == 'b')
+		tonic += 11, name++;
+	tonic %= 12;
+	while (*name == ' ')
+		name++;
+	if (!*name || !strcasecmp(name, "major") || !strcmp(name, "M"))
+		return tonic;
+	if (!strcasecmp(name, "minor") || !strcmp(name, "m"))
+		return 12 + tonic;
+	return -1;
+}
@@ -0,0 +1,71 @@
+/*
+ * catalog.h - append-only catalog of recorded takes
+ *
+ * The catalog is a header followed by fixed-size entries, so it can be
+ * mmap()ed and indexed by entry number.  Entries are appended while
+ * holding an exclusive flock(), and end_us never decreases from one
+ * entry to the next, so a time range is found by binary search.
+ * Other orders are kept in a separate index file (<catalog>.idx) that
+ * the query tool brings up to date when the catalog has grown.
+ * All integers are in host byte order.  Paths are limited to 215 bytes;
+ * takes with longer paths are not cataloged.
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+
+#define CATALOG_MAGIC		"ARMCAT1"
+#define CATALOG_INDEX_MAGIC	"ARMIDX2"
+#define CATALOG_KEY_UNKNOWN	(-1)
+
+struct catalog_header {
+	char magic[8];
+	uint32_t entry_size;
+	uint32_t reserved;
+};
+
+struct catalog_entry {
+	uint64_t start_us;	/* time of the first tick, us since the epoch */
+	uint64_t end_us;	/* time the take was finalized */
+	uint32_t duration_ms;
+	uint32_t notes;
+	uint32_t messages;
+	uint16_t channels;	/* bit mask */
+	uint8_t client;		/* source port */
+	uint8_t port;
+	int8_t key;		/* 0-11: C..B major, 12-23: C..B minor */
+	uint8_t reserved[7];
+	char path[216];		/* absolute, NUL-terminated: at most 215 bytes */
+};
+
+/* the secondary orders kept in the index file */
+enum catalog_order {
+	CATALOG_BY_PORT,
+	CATALOG_BY_KEY,
+	CATALOG_BY_DURATION,
+	CATALOG_ORDERS
+};
+
+/*
+ * The index file: this header, then for each order a sorted array of
+ * 'entries' entry numbers.  The catalog it was built from is identified
+ * by its inode and the first and last entries covered; an index of a
+ * catalog that was since recreated or rewritten is built again.
+ */
+struct catalog_index_header {
+	char magic[8];
+	uint32_t entries;	/* catalog entries covered */
+	uint32_t reserved;
+	uint64_t ino;		/* of the catalog */
+	uint64_t first_start_us;	/* start_us of entry 0 */
+	uint64_t last_end_us;	/* end_us of entry 'entries' - 1 */
+};
+
+int catalog_append(const char *catalog, struct catalog_entry *entry);
+int catalog_estimate_key(const unsigned long *pitches);
+const char *catalog_key_name(int key);
+int catalog_parse_key(const char *name);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * control.c - the command socket of an armed recorder
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Both sockets are non-blocking and polled together with the
+ * sequencer, so a command is handled between two reads of events.
+ * The client's bytes are kept in a fixed buffer until they make up a
+ * line; a line that does not fit is answered with an error and
+ * dropped up to its newline.
+ */
+
+#define _GNU_SOURCE	/* accept4() */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+
+static int listen_fd = -1;
+static int client_fd = -1;
+static const char *socket_path;
+static char line[CONTROL_LINE_MAX];
+static size_t line_len;		/* bytes received */
+static size_t line_done;	/* of which commands already returned */
+static int overlong;		/* dropping a line that does not fit */
+
+/* listens on 'path', replacing a socket left by a previous run */
+int control_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		return -errno;
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 4) < 0) {
+		int err = -errno;
+
+		close(listen_fd);
+		listen_fd = -1;
+		return err;
+	}
+	socket_path = path;
+	return 0;
+}
+
+/* the listening socket and the client, if any (poll() skips a -1) */
+void control_poll_descriptors(struct pollfd *pfds)
+{
+	pfds[0].fd = listen_fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	pfds[1].fd = client_fd;
+	pfds[1].events = POLLIN;
+	pfds[1].revents = 0;
+}
+
+static void disconnect(void)
+{
+	close(client_fd);
+	client_fd = -1;
+	line_len = line_done = 0;
+	overlong = 0;
+}
+
+void control_reply(const char *fmt, ...)
+{
+	char reply[CONTROL_LINE_MAX + 64];
+	va_list ap;
+	int len;
+
+	if (client_fd < 0)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(reply, sizeof(reply) - 1, fmt, ap);
+	va_end(ap);
+	if (len > (int)sizeof(reply) - 2)
+		len = sizeof(reply) - 2;
+	reply[len++] = '\n';
+	/* a client that does not read its answers is dropped */
+	if (send(client_fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+		disconnect();
+}
+
+/* the next complete line in the buffer, without its newline, or NULL */
+static char *next_line(void)
+{
+	char *start = line + line_done;
+	char *nl = memchr(start, '\n', line_len - line_done);
+
+	if (!nl)
+		return NULL;
+	*nl = '\0';
+	if (nl > start && nl[-1] == '\r')
+		nl[-1] = '\0';
+	line_done = nl + 1 - line;
+	return start;
+}
+
+/* the next command from the client, reading what it sent if needed */
+static char *read_command(void)
+{
+	char *command = next_line();
+	ssize_t n;
+
+	if (command)
+		return command;
+	/* keep the start of a partial line */
+	memmove(line, line + line_done, line_len - line_done);
+	line_len -= line_done;
+	line_done = 0;
+
+	n = recv(client_fd, line + line_len, sizeof(line) - line_len, 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		disconnect();
+		return NULL;
+	}
+	if (n < 0)
+		return NULL;
+	line_len += n;
+	if (overlong) {
+		char *nl = memchr(line, '\n', line_len);
+
+		if (!nl) {
+			line_len = 0;
+			return NULL;
+		}
+		line_done = nl + 1 - line;
+		overlong = 0;
+	}
+	command = next_line();
+	if (!command && line_len == sizeof(line)) {
+		control_reply("error command too long");
+		line_len = line_done = 0;
+		overlong = 1;
+	}
+	return command;
+}
+
+/*
+ * Reads what the client sent and accepts a new one, after poll()
+ * returned on 'pfds'.  Returns the next command, or NULL when there is
+ * none; call it again until it returns NULL, since a read may bring
+ * several.
+ */
+char *control_command(const struct pollfd *pfds)
+{
+	int fd;
+
+	/* first, so that a client that has gone is noticed */
+	if (client_fd >= 0) {
+		char *command = read_command();
+
+		if (command)
+			return command;
+	}
+	if (!(pfds[0].revents & POLLIN))
+		return NULL;
+	fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (client_fd >= 0) {
+		static const char busy[] = "error another client is connected\n";
+
+		send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+		return NULL;
+	}
+	client_fd = fd;
+	return read_command();
+}
+
+void control_close(void)
+{
+	if (client_fd >= 0)
+		disconnect();
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(socket_path);
+	}
+}
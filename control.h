@@ -0,0 +1,27 @@
+/*
+ * control.h - the command socket of an armed recorder
+ *
+ * With --control=path, the recorder listens on a Unix stream socket at
+ * 'path' and takes one command per line, e.g. "start", "stop",
+ * "rotate", "mark <label>" or "status", answering each with one line
+ * that starts with "ok" or "error".  One client is served at a time;
+ * another one is told so and disconnected.  Nothing is allocated after
+ * control_open(), so commands can be handled while recording.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <sys/poll.h>
+
+#define CONTROL_POLL_FDS	2	/* entries control_poll_descriptors() fills */
+#define CONTROL_LINE_MAX	256	/* longest command, with its newline */
+
+int control_open(const char *path);
+void control_poll_descriptors(struct pollfd *pfds);
+char *control_command(const struct pollfd *pfds);
+void control_reply(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+void control_close(void);
+
+#endif
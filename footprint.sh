@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Builds arecordmidi with -DSMALL_FOOTPRINT and checks its size against
+# budget.h: the static data (data and bss) against FOOTPRINT_MAX and the
+# code against FOOTPRINT_TEXT_MAX.  Prints both and the largest symbols,
+# and fails when either is over, so that a change that grows the small
+# build does not go unnoticed.  With a prefix, a cross toolchain is used
+# (CFLAGS can point it at the target's alsa-lib).
+#
+#   ./footprint.sh [cross-prefix]    e.g. ./footprint.sh aarch64-linux-gnu-
+cross=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+budget() {
+	printf '#include "budget.h"\n%s\n' "$1" |
+		${cross}gcc -DSMALL_FOOTPRINT -E -P -I. -x c - | tail -n 1
+}
+data_max=$(( $(budget FOOTPRINT_MAX) ))
+text_max=$(( $(budget FOOTPRINT_TEXT_MAX) ))
+
+${cross}gcc -Os -DSMALL_FOOTPRINT -ffunction-sections -fdata-sections \
+	-Wl,--gc-sections $CFLAGS -o "$dir/arecordmidi" \
+	arecordmidi.c smf.c catalog.c migrate.c retention.c control.c pack.c \
+	-lasound -lm -lpthread || exit 1
+
+read text data bss rest < <(${cross}size "$dir/arecordmidi" | tail -n 1)
+echo "text:       $text bytes, budget $text_max"
+echo "data + bss: $data + $bss = $((data + bss)) bytes, budget $data_max"
+echo "largest symbols:"
+${cross}nm --size-sort -S -t d "$dir/arecordmidi" | tail -n 10
+
+status=0
+if [ "$text" -gt "$text_max" ]; then
+	echo "text is over budget by $((text - text_max)) bytes"
+	status=1
+fi
+if [ $((data + bss)) -gt "$data_max" ]; then
+	echo "data + bss is over budget by $((data + bss - data_max)) bytes"
+	status=1
+fi
+exit $status
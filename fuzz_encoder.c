@@ -0,0 +1,151 @@
+/*
+ * fuzz_encoder.c - libFuzzer target for the encoder of arecordmidi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Each input is turned into sequencer events, which are queued, flushed
+ * and finished as a take the way events from a port are, into a memfd.
+ * There is no sequencer: the queue time is the virtual clock of
+ * --replay, set to the tick of each event as it is recorded.
+ * The --verify check then decodes the take with smf.c and compares its
+ * messages with the ones computed from the events, and the MTrk length
+ * with the data that follows; a difference aborts.  The recorder is
+ * built into this file, so that its static functions can be called.
+ */
+
+#define main arecordmidi_main
+#include "arecordmidi.c"
+#undef main
+
+#include <sys/mman.h>
+
+static const int fuzz_types[] = {
+	SND_SEQ_EVENT_NOTEON, SND_SEQ_EVENT_NOTEOFF, SND_SEQ_EVENT_KEYPRESS,
+	SND_SEQ_EVENT_CONTROLLER, SND_SEQ_EVENT_PGMCHANGE,
+	SND_SEQ_EVENT_CHANPRESS, SND_SEQ_EVENT_PITCHBEND,
+	SND_SEQ_EVENT_CONTROL14, SND_SEQ_EVENT_NONREGPARAM,
+	SND_SEQ_EVENT_REGPARAM, SND_SEQ_EVENT_SONGPOS, SND_SEQ_EVENT_SONGSEL,
+	SND_SEQ_EVENT_QFRAME, SND_SEQ_EVENT_START, SND_SEQ_EVENT_CONTINUE,
+	SND_SEQ_EVENT_STOP, SND_SEQ_EVENT_TUNE_REQUEST, SND_SEQ_EVENT_RESET,
+	SND_SEQ_EVENT_SENSING, EVENT_MARKER, SND_SEQ_EVENT_SYSEX,
+};
+#define FUZZ_TYPES (sizeof(fuzz_types) / sizeof(fuzz_types[0]))
+#define FUZZ_RECORD 7	/* input bytes per event, before any data */
+
+/*
+ * The take is written into memory, under a name that fopen() accepts,
+ * and the queue time is read from replay_tick instead of a sequencer.
+ */
+static void fuzz_init(void)
+{
+	static char path[32];
+	int fd = memfd_create("take", 0);
+
+	if (fd < 0)
+		fatal("Cannot create a memfd - %s", strerror(errno));
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	output = path;
+	replay = "fuzz input";
+	ticks = 384;
+	verify = true;
+	size_buffers();
+}
+
+/*
+ * An event is a type, a channel, two parameter bytes, two value bytes
+ * and the ticks since the event before; with its top bit set, the last
+ * byte makes a pause longer than a delta time can hold.  SysEx and
+ * markers are followed by a length byte and that much data.
+ */
+static size_t fuzz_event(snd_seq_event_t *ev, snd_seq_tick_time_t *tick,
+			 const uint8_t *data, size_t size)
+{
+	int value = data[4] | data[5] << 8;
+	size_t len;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->type = fuzz_types[data[0] % FUZZ_TYPES];
+	ev->queue = queue;
+	*tick += data[6] & 0x80 ? (snd_seq_tick_time_t)data[3] << 22 :
+		data[6];
+	ev->time.tick = *tick;
+	replay_tick = *tick;
+	switch (ev->type) {
+	case SND_SEQ_EVENT_NOTEON:
+	case SND_SEQ_EVENT_NOTEOFF:
+	case SND_SEQ_EVENT_KEYPRESS:
+		ev->data.note.channel = data[1] & 0xf;
+		ev->data.note.note = data[2] & 0x7f;
+		ev->data.note.velocity = data[4] & 0x7f;
+		break;
+	case SND_SEQ_EVENT_PITCHBEND:
+		ev->data.control.channel = data[1] & 0xf;
+		ev->data.control.value = (value & 0x3fff) - 8192;
+		break;
+	case SND_SEQ_EVENT_NONREGPARAM:
+	case SND_SEQ_EVENT_REGPARAM:
+		ev->data.control.channel = data[1] & 0xf;
+		ev->data.control.param = (data[2] | data[3] << 7) & 0x3fff;
+		ev->data.control.value = value & 0x3fff;
+		break;
+	case SND_SEQ_EVENT_SYSEX:
+	case EVENT_MARKER:
+		if (size < FUZZ_RECORD + 1)
+			return 0;
+		len = data[FUZZ_RECORD];
+		if (len == 0 || len > size - FUZZ_RECORD - 1)
+			return 0;
+		ev->data.ext.len = len;
+		ev->data.ext.ptr = (void *)(data + FUZZ_RECORD + 1);
+		return FUZZ_RECORD + 1 + len;
+	default:
+		ev->data.control.channel = data[1] & 0xf;
+		ev->data.control.param = data[2] & 0x7f;
+		ev->data.control.value = ev->type == SND_SEQ_EVENT_CONTROL14 ||
+			ev->type == SND_SEQ_EVENT_SONGPOS ?
+			value & 0x3fff : value & 0x7f;
+		break;
+	}
+	return FUZZ_RECORD;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	snd_seq_tick_time_t tick = 1;
+	snd_seq_event_t ev;
+	size_t used;
+
+	if (!output)
+		fuzz_init();
+	if (size < 1)
+		return 0;
+	replay_tick = 0;
+	/* flushes after every n events, so that they fall anywhere */
+	queue_size = 1 + data[0] % EVENT_QUEUE_SIZE;
+	data++;
+	size--;
+
+	start_take();
+	while (size >= FUZZ_RECORD &&
+	       (used = fuzz_event(&ev, &tick, data, size))) {
+		record_event(&ev);
+		data += used;
+		size -= used;
+	}
+	finish_take();
+	/* the check runs on the finisher thread */
+	stop_finisher();
+	if (verify_failed)
+		abort();
+	return 0;
+}
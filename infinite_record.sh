@@ -1,17 +1,13 @@
 #!/bin/bash
 
+# Takes are recorded into RAM and moved to ~/midi in the background;
+# each pause of 10 s ends a take.  Restart the recorder if it fails.
+staging=/dev/shm/arecordmidi
+mkdir -p $staging
+
 while true
 do
-	tmpfile=$(tempfile --suffix=.mid)
-	./arecordmidi -p 24 -T 10000 $tmpfile
-
-	if [ -f $tmpfile ]
-	then
-		outfile=$(date +arecordmidi-%Y-%m-%d-%H:%M:%S.mid)
-		mv $tmpfile ~/midi/$outfile
-	else
-		rm $tmpfile
-		sleep 5
-	fi
+	./arecordmidi -p 24 -T 10000 --summary --staging=$staging \
+		~/midi/arecordmidi-%Y-%m-%d-%H:%M:%S.mid
+	sleep 5
 done
-
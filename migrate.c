@@ -0,0 +1,470 @@
+/*
+ * migrate.c - move finished takes from a staging directory to storage
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Each file is copied to <dest>.tmp in chunks, no faster than the
+ * configured rate, while its checksum is computed.  The copy is synced,
+ * dropped from the page cache and read back; only if the checksums
+ * match is it renamed into place and its directory synced.  A crash at
+ * any point leaves the staged files and the marker, so the copy is
+ * simply redone by the next run.  A take that was still being recorded
+ * is valid up to its last flush, and is migrated the same way.
+ *
+ * The thread runs at idle I/O priority and the lowest CPU priority, so
+ * that the capture path, which only touches the staging directory,
+ * never waits for the slow device.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "migrate.h"
+
+#define CHUNK_SIZE 65536
+#define RETRY_MIN 1	/* seconds before a failed take is tried again */
+#define RETRY_MAX 300	/* the delay doubles up to this */
+
+/* <linux/ioprio.h> is not always installed */
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+
+struct pending {
+	struct pending *next;
+	double retry_at;	/* after a failure, when it is tried again */
+	int delay;		/* seconds to wait after the next failure */
+	void *arg;		/* for landed() */
+	char staged[];
+};
+
+static const char *staging_dir;
+static unsigned long max_rate;		/* bytes/s, 0: unlimited */
+static migrate_landed *landed;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct pending *head, **tail = &head;
+static struct pending *retries;		/* failed takes, the next due first */
+static int finishing;
+
+static uint64_t fnv1a(uint64_t hash, const unsigned char *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sleeps as long as needed to keep 'bytes' since 'start' within the rate */
+static void throttle(double start, unsigned long long bytes)
+{
+	double ahead;
+	struct timespec ts;
+
+	if (!max_rate)
+		return;
+	ahead = start + (double)bytes / max_rate - now();
+	if (ahead <= 0)
+		return;
+	ts.tv_sec = ahead;
+	ts.tv_nsec = (ahead - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);
+}
+
+static int fsync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	int fd, err = 0;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) < 0)
+		err = -errno;
+	close(fd);
+	return err;
+}
+
+/* reads a file back from the device and returns its checksum */
+static int checksum(int fd, uint64_t *hash)
+{
+	static unsigned char buf[CHUNK_SIZE];
+	ssize_t n;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	*hash = 0xcbf29ce484222325ULL;
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -errno;
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		*hash = fnv1a(*hash, buf, n);
+	}
+	return 0;
+}
+
+/* copies one file with checksum verification, then renames it into place */
+static int copy_file(const char *from, const char *to)
+{
+	static unsigned char buf[CHUNK_SIZE];
+	char tmp[PATH_MAX + 4];
+	uint64_t hash = 0xcbf29ce484222325ULL, copied;
+	unsigned long long bytes = 0;
+	double start = now();
+	int in, out, err = 0;
+	ssize_t n;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", to);
+	in = open(from, O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return -errno;
+	out = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		err = -errno;
+		close(in);
+		return err;
+	}
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			err = -errno;
+			break;
+		}
+		hash = fnv1a(hash, buf, n);
+		err = write_all(out, buf, n);
+		if (err < 0)
+			break;
+		bytes += n;
+		throttle(start, bytes);
+	}
+	if (!err && fsync(out) < 0)
+		err = -errno;
+	if (!err)
+		err = checksum(out, &copied);
+	if (!err && copied != hash)
+		err = -EIO;
+	close(in);
+	if (close(out) < 0 && !err)
+		err = -errno;
+	if (!err && rename(tmp, to) < 0)
+		err = -errno;
+	if (!err)
+		err = fsync_dir(to);
+	if (err)
+		unlink(tmp);
+	return err;
+}
+
+/* reads the destination of a staged take from its marker */
+static int read_marker(const char *staged, char *dest, size_t size)
+{
+	char marker[PATH_MAX + 8];
+	FILE *f;
+	int ok;
+
+	snprintf(marker, sizeof(marker), "%s.dest", staged);
+	f = fopen(marker, "r");
+	if (!f)
+		return -errno;
+	ok = fgets(dest, size, f) != NULL;
+	fclose(f);
+	if (!ok || !*dest)
+		return -EINVAL;
+	dest[strcspn(dest, "\n")] = 0;
+	return 0;
+}
+
+/* whether a staging directory entry is a sidecar of the take 'name' */
+static int is_sidecar(const char *entry, const char *name, size_t len)
+{
+	return !strncmp(entry, name, len) && entry[len] == '.' &&
+		strncmp(entry + len, ".dest", 5);
+}
+
+/*
+ * Migrates the take and every <take>.* sidecar except the marker, to
+ * the destination it returns in 'dest'.
+ */
+static int migrate(const char *staged, char *dest, size_t size)
+{
+	char from[PATH_MAX], to[PATH_MAX * 2], marker[PATH_MAX + 8];
+	const char *name = strrchr(staged, '/') + 1;
+	size_t len = strlen(name);
+	struct dirent *de;
+	DIR *dir;
+	int err;
+
+	err = read_marker(staged, dest, size);
+	if (err < 0)
+		return err;
+	dir = opendir(staging_dir);
+	if (!dir)
+		return -errno;
+	while ((de = readdir(dir))) {
+		if (!is_sidecar(de->d_name, name, len))
+			continue;
+		snprintf(from, sizeof(from), "%s/%s", staging_dir, de->d_name);
+		snprintf(to, sizeof(to), "%s%s", dest, de->d_name + len);
+		err = copy_file(from, to);
+		if (err < 0)
+			break;
+	}
+	closedir(dir);
+	/* the take itself last, so that its sidecars are there when it appears */
+	if (!err && access(staged, F_OK) == 0)
+		err = copy_file(staged, dest);
+	if (err < 0)
+		return err;
+
+	dir = opendir(staging_dir);
+	if (dir) {
+		while ((de = readdir(dir))) {
+			if (!is_sidecar(de->d_name, name, len))
+				continue;
+			snprintf(from, sizeof(from), "%s/%s", staging_dir, de->d_name);
+			unlink(from);
+		}
+		closedir(dir);
+	}
+	unlink(staged);
+	snprintf(marker, sizeof(marker), "%s.dest", staged);
+	unlink(marker);
+	return 0;
+}
+
+/*
+ * Migrates a take, or after a failure, e.g. while the destination is
+ * unmounted or full, queues it to be tried again later, twice as late
+ * each time.  When the recorder exits, a take that fails stays in the
+ * staging directory for the next run.
+ */
+static void migrate_pending(struct pending *p)
+{
+	char dest[PATH_MAX], marker[PATH_MAX + 8];
+	struct pending **pos;
+	int err = migrate(p->staged, dest, sizeof(dest));
+
+	snprintf(marker, sizeof(marker), "%s.dest", p->staged);
+	/* gone, e.g. removed by hand: nothing to retry */
+	if (err >= 0 || access(marker, F_OK) < 0) {
+		landed(err >= 0 ? dest : NULL, p->arg);
+		free(p);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	if (finishing) {
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "Cannot migrate %s - %s; it stays in the staging directory\n",
+			p->staged, strerror(-err));
+		landed(NULL, p->arg);
+		free(p);
+		return;
+	}
+	fprintf(stderr, "Cannot migrate %s - %s; trying again in %d s\n",
+		p->staged, strerror(-err), p->delay);
+	p->retry_at = now() + p->delay;
+	p->delay = p->delay * 2 < RETRY_MAX ? p->delay * 2 : RETRY_MAX;
+	for (pos = &retries; *pos && (*pos)->retry_at <= p->retry_at; pos = &(*pos)->next)
+		;
+	p->next = *pos;
+	*pos = p;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Takes the next take to migrate off its list: a new one, a failed one
+ * that is due, or when finishing, any failed one.  The lock is held.
+ */
+static struct pending *next_pending(void)
+{
+	struct pending *p = head;
+
+	if (p) {
+		head = p->next;
+		if (!head)
+			tail = &head;
+		return p;
+	}
+	p = retries;
+	if (p && (finishing || p->retry_at <= now())) {
+		retries = p->next;
+		return p;
+	}
+	return NULL;
+}
+
+static void *migrate_thread(void *arg)
+{
+	struct pending *p;
+	struct timespec ts;
+
+	(void)arg;
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!(p = next_pending()) && !finishing) {
+			if (!retries) {
+				pthread_cond_wait(&cond, &lock);
+				continue;
+			}
+			ts.tv_sec = retries->retry_at;
+			ts.tv_nsec = (retries->retry_at - ts.tv_sec) * 1e9;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+		}
+		pthread_mutex_unlock(&lock);
+		if (!p)
+			break;
+		migrate_pending(p);
+	}
+	return NULL;
+}
+
+static void queue_take(const char *staged, void *arg)
+{
+	struct pending *p = malloc(sizeof(*p) + strlen(staged) + 1);
+
+	if (!p) {
+		fprintf(stderr, "Out of memory, %s stays in the staging directory\n",
+			staged);
+		landed(NULL, arg);
+		return;
+	}
+	p->next = NULL;
+	p->retry_at = 0;
+	p->delay = RETRY_MIN;
+	p->arg = arg;
+	strcpy(p->staged, staged);
+	pthread_mutex_lock(&lock);
+	*tail = p;
+	tail = &p->next;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Starts the migration thread, and queues the takes left in the staging
+ * directory by a previous run; a new take does not reuse their names
+ * while they are there.  'rate' limits the copy bandwidth in bytes/s
+ * (0: unlimited).  Returns 0 or -errno.
+ */
+int migrate_start(const char *staging, unsigned long rate,
+		  migrate_landed *landed_fn)
+{
+	pthread_condattr_t attr;
+	struct dirent *de;
+	DIR *dir;
+	int err;
+
+	staging_dir = staging;
+	max_rate = rate;
+	landed = landed_fn;
+	/* retries are timed with now() */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+	dir = opendir(staging);
+	if (!dir)
+		return -errno;
+	while ((de = readdir(dir))) {
+		char staged[PATH_MAX];
+		size_t len = strlen(de->d_name);
+
+		if (len <= 5 || strcmp(de->d_name + len - 5, ".dest"))
+			continue;
+		snprintf(staged, sizeof(staged), "%s/%.*s", staging,
+			 (int)(len - 5), de->d_name);
+		fprintf(stderr, "Migrating %s left by a previous run\n", staged);
+		queue_take(staged, NULL);
+	}
+	closedir(dir);
+
+	err = pthread_create(&thread, NULL, migrate_thread, NULL);
+	return -err;
+}
+
+/* creates the marker of a take that is about to be recorded */
+int migrate_begin(const char *staged, const char *dest)
+{
+	char marker[PATH_MAX + 8], tmp[PATH_MAX + 12];
+	FILE *f;
+
+	snprintf(marker, sizeof(marker), "%s.dest", staged);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", marker);
+	f = fopen(tmp, "w");
+	if (!f)
+		return -errno;
+	fprintf(f, "%s\n", dest);
+	if (fclose(f) || rename(tmp, marker) < 0)
+		return -errno;
+	return 0;
+}
+
+/* queues a finished take */
+void migrate_take(const char *staged, void *arg)
+{
+	queue_take(staged, arg);
+}
+
+/* waits until all queued takes have been migrated */
+void migrate_finish(void)
+{
+	pthread_mutex_lock(&lock);
+	finishing = 1;
+	if (head || retries)
+		fputs("Waiting for takes to be migrated...\n", stderr);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+}
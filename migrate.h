@@ -0,0 +1,29 @@
+/*
+ * migrate.h - move finished takes from a staging directory to storage
+ *
+ * The recorder writes each take into a fast (RAM-backed) staging
+ * directory.  When a take is started, a marker <take>.dest holding its
+ * destination path is created next to it; when it is finished, it is
+ * queued for a background thread that copies the take and its
+ * sidecars (<take>.*) to the destination, checks them, and removes the
+ * staged files, the marker last.  A take that fails is tried again
+ * later.  Markers left by a previous run are queued at startup.
+ *
+ * For each queued take, the 'landed' function is called on the thread
+ * with its destination once it is in place, or with NULL when it stays
+ * in the staging directory, and with the 'arg' it was queued with (NULL
+ * for a take left by a previous run).
+ */
+
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+typedef void migrate_landed(const char *dest, void *arg);
+
+int migrate_start(const char *staging, unsigned long rate,
+		  migrate_landed *landed);
+int migrate_begin(const char *staged, const char *dest);
+void migrate_take(const char *staged, void *arg);
+void migrate_finish(void);
+
+#endif
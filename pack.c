@@ -0,0 +1,187 @@
+/*
+ * pack.c - the encoder's fast path for runs of short channel messages
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Of the four bytes of a record, the delta time and the first data byte
+ * are always written; the status byte is dropped when it equals the one
+ * of the record before, and the second data byte when the message has
+ * only one.  For four records in a vector, the eight bits saying which
+ * bytes are dropped index a table of shuffles that move the kept bytes
+ * to the front, and the vector is stored whole: the bytes past the kept
+ * ones are overwritten by the next store.  Each store starts at most
+ * 4 bytes per record before it, so nothing is written past 4 * n.
+ */
+
+#include <stdbool.h>
+#include "pack.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static bool one_data_byte(unsigned char status)
+{
+	/* program change and channel pressure */
+	return (status & 0xe0) == 0xc0;
+}
+
+size_t pack_messages_scalar(unsigned char *out, const uint32_t *records,
+			    size_t n, unsigned char *running)
+{
+	unsigned char *p = out;
+	unsigned char last = *running;
+
+	for (size_t i = 0; i < n; i++) {
+		uint32_t r = records[i];
+		unsigned char status = r >> 8;
+
+		*p++ = r;
+		if (status != last)
+			*p++ = status;
+		*p++ = r >> 16;
+		if (!one_data_byte(status))
+			*p++ = r >> 24;
+		last = status;
+	}
+	*running = last;
+	return p - out;
+}
+
+#ifdef HAVE_X86_SIMD
+/* by the dropped bytes: bit 2k for the status of record k, 2k + 1 its data */
+static unsigned char shuffles[256][16] __attribute__((aligned(16)));
+static unsigned char lengths[256];
+
+static void init_shuffles(void)
+{
+	for (int m = 0; m < 256; m++) {
+		int len = 0;
+
+		/* the odd bytes of the vector are those that can be dropped */
+		for (int b = 0; b < 16; b++)
+			if (!(b & 1) || !(m & 1 << (b >> 1)))
+				shuffles[m][len++] = b;
+		lengths[m] = len;
+		while (len < 16)
+			shuffles[m][len++] = 0x80;
+	}
+}
+
+__attribute__((target("ssse3")))
+static size_t pack_ssse3(unsigned char *out, const uint32_t *records,
+			 size_t n, unsigned char *running)
+{
+	const __m128i status_byte = _mm_set1_epi32(0x0000ff00);
+	const __m128i type = _mm_set1_epi32(0x0000e000);
+	const __m128i one_byte = _mm_set1_epi32(0x0000c000);
+	const __m128i odd = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15,
+					  -128, -128, -128, -128,
+					  -128, -128, -128, -128);
+	unsigned char *p = out;
+	uint32_t last = *running;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(records + i));
+		/* each record next to the status before it */
+		__m128i prev = _mm_or_si128(_mm_slli_si128(x, 4),
+					    _mm_cvtsi32_si128(last << 8));
+		__m128i same = _mm_and_si128(_mm_cmpeq_epi8(x, prev), status_byte);
+		__m128i single = _mm_cmpeq_epi8(_mm_and_si128(x, type), one_byte);
+		__m128i drop;
+		int m;
+
+		/* from the status byte to the second data byte */
+		single = _mm_slli_epi32(_mm_and_si128(single, status_byte), 16);
+		drop = _mm_or_si128(same, single);
+		m = _mm_movemask_epi8(_mm_shuffle_epi8(drop, odd));
+		_mm_storeu_si128((__m128i *)p, _mm_shuffle_epi8(x,
+			_mm_load_si128((const __m128i *)shuffles[m])));
+		p += lengths[m];
+		last = records[i + 3] >> 8 & 0xff;
+	}
+	*running = last;
+	return p - out + pack_messages_scalar(p, records + i, n - i, running);
+}
+
+/* the same, eight records at a time: a table lookup for each lane */
+__attribute__((target("avx2")))
+static size_t pack_avx2(unsigned char *out, const uint32_t *records,
+			size_t n, unsigned char *running)
+{
+	const __m256i status_byte = _mm256_set1_epi32(0x0000ff00);
+	const __m256i type = _mm256_set1_epi32(0x0000e000);
+	const __m256i one_byte = _mm256_set1_epi32(0x0000c000);
+	const __m256i odd = _mm256_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15,
+					     -128, -128, -128, -128,
+					     -128, -128, -128, -128,
+					     1, 3, 5, 7, 9, 11, 13, 15,
+					     -128, -128, -128, -128,
+					     -128, -128, -128, -128);
+	unsigned char *p = out;
+	uint32_t last = *running;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(records + i));
+		/* shifted by a record across the lanes */
+		__m256i prev = _mm256_alignr_epi8(x,
+			_mm256_permute2x128_si256(x, x, 0x08), 12);
+		__m256i same, single, drop, shuffle, y;
+		int m, lo, hi;
+
+		prev = _mm256_or_si256(prev, _mm256_setr_epi32(last << 8,
+							       0, 0, 0, 0, 0, 0, 0));
+		same = _mm256_and_si256(_mm256_cmpeq_epi8(x, prev), status_byte);
+		single = _mm256_cmpeq_epi8(_mm256_and_si256(x, type), one_byte);
+		single = _mm256_slli_epi32(_mm256_and_si256(single, status_byte), 16);
+		drop = _mm256_or_si256(same, single);
+		m = _mm256_movemask_epi8(_mm256_shuffle_epi8(drop, odd));
+		lo = m & 0xff;
+		hi = m >> 16 & 0xff;
+		shuffle = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_load_si128((const __m128i *)shuffles[lo])),
+			_mm_load_si128((const __m128i *)shuffles[hi]), 1);
+		y = _mm256_shuffle_epi8(x, shuffle);
+		_mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(y));
+		p += lengths[lo];
+		_mm_storeu_si128((__m128i *)p, _mm256_extracti128_si256(y, 1));
+		p += lengths[hi];
+		last = records[i + 7] >> 8 & 0xff;
+	}
+	*running = last;
+	return p - out + pack_messages_scalar(p, records + i, n - i, running);
+}
+#endif
+
+static size_t (*pack)(unsigned char *out, const uint32_t *records, size_t n,
+		      unsigned char *running);
+
+size_t pack_messages(unsigned char *out, const uint32_t *records, size_t n,
+		     unsigned char *running)
+{
+	if (!pack) {
+		pack = pack_messages_scalar;
+#ifdef HAVE_X86_SIMD
+		init_shuffles();
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			pack = pack_avx2;
+		else if (__builtin_cpu_supports("ssse3"))
+			pack = pack_ssse3;
+#endif
+	}
+	return pack(out, records, n, running);
+}
@@ -0,0 +1,35 @@
+/*
+ * pack.h - the encoder's fast path for runs of short channel messages
+ *
+ * A record is one channel message of fixed size with a one-byte delta
+ * time, in a 32-bit word: the delta time in the low byte, then the
+ * status byte and the two data bytes.  pack_messages() writes a run of
+ * records as SMF track data: the delta time, the status byte unless
+ * running status allows leaving it out, and one data byte for program
+ * changes and channel pressure or two for the others.  On x86 it packs
+ * four or eight records at a time with SSSE3 or AVX2 shuffles, chosen
+ * at run time; the output is the same byte for byte as that of
+ * pack_messages_scalar().
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACK_RECORD(delta, status, d1, d2) \
+	((uint32_t)(delta) | (uint32_t)(status) << 8 | \
+	 (uint32_t)(d1) << 16 | (uint32_t)(d2) << 24)
+
+/*
+ * Both write at most 4 bytes per record to 'out', and return how many
+ * they wrote.  '*running' is the running status before the run, 0 for
+ * none, and is updated to the one after it.
+ */
+size_t pack_messages(unsigned char *out, const uint32_t *records, size_t n,
+		     unsigned char *running);
+size_t pack_messages_scalar(unsigned char *out, const uint32_t *records,
+			    size_t n, unsigned char *running);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * retention.c - keep the takes in a directory within a quota and an age
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * The index is an array in the order the takes were finished, so the
+ * newest take is the last one.  Victims are picked and removed from it
+ * under the lock, and the files are deleted after the lock is dropped,
+ * so that adding a take never waits for the disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "retention.h"
+
+#define UNKNOWN UINT32_MAX
+#define CHECK_INTERVAL 60	/* seconds between age checks */
+
+struct take {
+	int64_t end;		/* time it was finished, s since the epoch */
+	uint64_t bytes;		/* with its sidecars */
+	uint32_t duration_ms;
+	uint32_t notes;
+	char *path;
+};
+
+/* a directory entry, for the scan at startup */
+struct entry {
+	char *name;
+	uint64_t size;
+	int64_t mtime;
+};
+
+static struct retention_config config;
+static char index_dir[PATH_MAX];
+static const char *index_suffix;
+static struct take *takes;
+static size_t count, alloc;
+static uint64_t total;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int finishing;
+
+static int add(const char *path, int64_t end, uint64_t bytes,
+	       uint32_t duration_ms, uint32_t notes)
+{
+	if (count == alloc) {
+		size_t n = alloc ? alloc * 2 : 256;
+		struct take *t = realloc(takes, n * sizeof(*t));
+
+		if (!t)
+			return -ENOMEM;
+		takes = t;
+		alloc = n;
+	}
+	takes[count].path = strdup(path);
+	if (!takes[count].path)
+		return -ENOMEM;
+	takes[count].end = end;
+	takes[count].bytes = bytes;
+	takes[count].duration_ms = duration_ms;
+	takes[count].notes = notes;
+	total += bytes;
+	count++;
+	return 0;
+}
+
+/*
+ * Returns the size of a take and of all its <take>.* sidecars, and
+ * deletes them if 'remove' is set.
+ */
+static uint64_t take_files(const char *path, int remove)
+{
+	const char *slash = strrchr(path, '/');
+	const char *name = slash ? slash + 1 : path;
+	size_t len = strlen(name);
+	char dir[PATH_MAX], file[PATH_MAX * 2];
+	uint64_t bytes = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) : 1,
+		 slash ? path : ".");
+	if (!*dir)
+		strcpy(dir, "/");
+	if (stat(path, &st) == 0)
+		bytes = st.st_size;
+	if (remove && unlink(path) < 0 && errno != ENOENT)
+		fprintf(stderr, "Cannot delete %s - %s\n", path, strerror(errno));
+	d = opendir(dir);
+	if (!d)
+		return bytes;
+	while ((de = readdir(d))) {
+		if (strncmp(de->d_name, name, len) || de->d_name[len] != '.')
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", dir, de->d_name);
+		if (stat(file, &st) == 0)
+			bytes += st.st_size;
+		if (remove)
+			unlink(file);
+	}
+	closedir(d);
+	return bytes;
+}
+
+uint64_t retention_measure(const char *path)
+{
+	return take_files(path, 0);
+}
+
+/* reads the duration and the note count from a take's .summary */
+static void read_summary(const char *path, uint32_t *duration_ms,
+			 uint32_t *notes)
+{
+	char file[PATH_MAX + 8], line[256];
+	double duration;
+	unsigned long n;
+	FILE *f;
+
+	*duration_ms = *notes = UNKNOWN;
+	if (snprintf(file, sizeof(file), "%s.summary", path) >= (int)sizeof(file))
+		return;
+	f = fopen(file, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "duration: %lf", &duration) == 1)
+			*duration_ms = duration * 1000;
+		else if (sscanf(line, "notes: %lu", &n) == 1)
+			*notes = n;
+	}
+	fclose(f);
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *)a)->name,
+		      ((const struct entry *)b)->name);
+}
+
+static int by_end(const void *a, const void *b)
+{
+	const struct take *x = a, *y = b;
+
+	return (x->end > y->end) - (x->end < y->end);
+}
+
+/*
+ * Builds the index from the directory.  After sorting by name, the
+ * sidecars of a take directly follow it, since they share its name as
+ * a prefix.
+ */
+static int scan(const char *dir, const char *suffix)
+{
+	struct entry *entries = NULL;
+	size_t n = 0, size = 0, slen = strlen(suffix);
+	char path[PATH_MAX * 2];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int err = 0;
+
+	d = opendir(dir);
+	if (!d)
+		return -errno;
+	while ((de = readdir(d))) {
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == size) {
+			struct entry *e;
+
+			size = size ? size * 2 : 256;
+			e = realloc(entries, size * sizeof(*e));
+			if (!e) {
+				err = -ENOMEM;
+				break;
+			}
+			entries = e;
+		}
+		entries[n].name = strdup(de->d_name);
+		if (!entries[n].name) {
+			err = -ENOMEM;
+			break;
+		}
+		entries[n].size = st.st_size;
+		entries[n].mtime = st.st_mtime;
+		n++;
+	}
+	closedir(d);
+	qsort(entries, n, sizeof(*entries), by_name);
+
+	for (size_t i = 0; i < n && !err; i++) {
+		const char *name = entries[i].name;
+		size_t len = strlen(name);
+		uint64_t bytes = entries[i].size;
+		uint32_t duration_ms, notes;
+
+		if (len <= slen || strcmp(name + len - slen, suffix))
+			continue;
+		for (size_t j = i + 1; j < n && !strncmp(entries[j].name, name, len); j++)
+			if (entries[j].name[len] == '.')
+				bytes += entries[j].size;
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		read_summary(path, &duration_ms, &notes);
+		err = add(path, entries[i].mtime, bytes, duration_ms, notes);
+	}
+	for (size_t i = 0; i < n; i++)
+		free(entries[i].name);
+	free(entries);
+	qsort(takes, count, sizeof(*takes), by_end);
+	return err;
+}
+
+/*
+ * Picks the next take to delete, or returns -1.  Sets 'reason'.
+ * Called with the lock held.
+ */
+static long pick(int64_t now, const char **reason)
+{
+	long victim = -1;
+
+	if (count < 2)
+		return -1;
+	/* the index is in the order of end times */
+	if (config.max_age && takes[0].end < now - (int64_t)config.max_age) {
+		*reason = "too old";
+		return 0;
+	}
+	if (!config.quota || total <= config.quota)
+		return -1;
+
+	*reason = "quota";
+	for (size_t i = 0; i < count - 1; i++)
+		if (takes[i].notes == 0)
+			return i;
+	for (size_t i = 0; i < count - 1; i++) {
+		if (config.order == RETENTION_OLDEST)
+			return i;
+		if (takes[i].duration_ms != UNKNOWN &&
+		    (victim < 0 || takes[i].duration_ms < takes[victim].duration_ms))
+			victim = i;
+	}
+	/* fall back to the oldest if no duration is known */
+	return victim < 0 ? 0 : victim;
+}
+
+static void *retention_thread(void *arg)
+{
+	struct timespec ts;
+	const char *reason;
+	long victim;
+
+	(void)arg;
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	pthread_mutex_lock(&lock);
+	while (!finishing) {
+		victim = pick(time(NULL), &reason);
+		if (victim >= 0) {
+			struct take t = takes[victim];
+
+			memmove(takes + victim, takes + victim + 1,
+				(count - victim - 1) * sizeof(*takes));
+			count--;
+			total -= t.bytes;
+			pthread_mutex_unlock(&lock);
+
+			fprintf(stderr, "Deleting %s (%s)\n", t.path, reason);
+			take_files(t.path, 1);
+			free(t.path);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += CHECK_INTERVAL;
+		pthread_cond_timedwait(&cond, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Indexes the takes in 'dir', those whose names end with 'suffix', and
+ * starts the thread that enforces 'cfg'.  Returns 0 or -errno.
+ */
+int retention_start(const char *dir, const char *suffix,
+		    const struct retention_config *cfg)
+{
+	int err;
+
+	config = *cfg;
+	snprintf(index_dir, sizeof(index_dir), "%s", dir);
+	index_suffix = suffix;
+	err = scan(dir, suffix);
+	if (err < 0)
+		return err;
+	return -pthread_create(&thread, NULL, retention_thread, NULL);
+}
+
+/* adds a finished take; 'bytes' from retention_measure() */
+void retention_add(const char *path, uint64_t bytes, uint32_t duration_ms,
+		   uint32_t notes)
+{
+	pthread_mutex_lock(&lock);
+	if (add(path, time(NULL), bytes, duration_ms, notes) < 0)
+		fprintf(stderr, "Out of memory, %s is not under retention\n", path);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Adds a take that arrived without its statistics, e.g. one a previous
+ * run left staged, if it belongs to the index; its duration and note
+ * count are read from its .summary, as at startup.
+ */
+void retention_add_summary(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = strlen(path), slen = strlen(index_suffix);
+	uint32_t duration_ms, notes;
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) : 1,
+		 slash ? path : ".");
+	if (strcmp(*dir ? dir : "/", index_dir) || len <= slen ||
+	    strcmp(path + len - slen, index_suffix))
+		return;
+	read_summary(path, &duration_ms, &notes);
+	retention_add(path, retention_measure(path), duration_ms, notes);
+}
+
+void retention_finish(void)
+{
+	pthread_mutex_lock(&lock);
+	finishing = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	for (size_t i = 0; i < count; i++)
+		free(takes[i].path);
+	free(takes);
+	takes = NULL;
+	count = alloc = 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * retention.h - keep the takes in a directory within a quota and an age
+ *
+ * The recorder keeps an index of the finished takes in its output
+ * directory: built once at startup from the directory and the .summary
+ * sidecars, then updated as takes are finished, or with a staging
+ * directory, as they arrive.  A background thread
+ * deletes takes, with their sidecars, when the total size exceeds the
+ * quota or a take is older than the maximum age.  Takes without notes
+ * go first, then the oldest or the shortest ones.  The newest take is
+ * never deleted.
+ */
+
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdint.h>
+
+enum retention_order {
+	RETENTION_OLDEST,
+	RETENTION_SHORTEST,
+};
+
+struct retention_config {
+	uint64_t quota;			/* bytes, 0: none */
+	unsigned long max_age;		/* seconds, 0: none */
+	enum retention_order order;
+};
+
+int retention_start(const char *dir, const char *suffix,
+		    const struct retention_config *config);
+uint64_t retention_measure(const char *path);
+void retention_add(const char *path, uint64_t bytes, uint32_t duration_ms,
+		   uint32_t notes);
+void retention_add_summary(const char *path);
+void retention_finish(void);
+
+#endif
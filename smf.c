@@ -0,0 +1,419 @@
+/*
+ * smf.c - minimal standard MIDI file decoder
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "smf.h"
+
+static uint32_t read_32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* parses the MThd chunk and the header of the first MTrk chunk */
+int smf_read_header(const unsigned char *buf, size_t len,
+		    struct smf_header *header)
+{
+	uint32_t header_length;
+
+	/* a take recorded with --zstd starts with a zstd frame */
+	if (len >= 4 && !memcmp(buf, "\x28\xb5\x2f\xfd", 4))
+		return SMF_ERR_COMPRESSED;
+	if (len < SMF_HEADER_SIZE + SMF_TRACK_HEADER_SIZE)
+		return SMF_NEED_MORE;
+	if (memcmp(buf, "MThd", 4))
+		return SMF_ERR_HEADER;
+	header_length = read_32(buf + 4);
+	if (header_length < 6 ||
+	    header_length > len - 8 - SMF_TRACK_HEADER_SIZE)
+		return SMF_ERR_HEADER;
+	header->format = buf[8] << 8 | buf[9];
+	header->tracks = buf[10] << 8 | buf[11];
+	header->division = buf[12] << 8 | buf[13];
+	if (header->format > 2 || header->tracks < 1 || !header->division)
+		return SMF_ERR_HEADER;
+
+	buf += 8 + header_length;
+	if (memcmp(buf, "MTrk", 4))
+		return SMF_ERR_HEADER;
+	header->track_length = read_32(buf + 4);
+	header->track_offset = 8 + header_length + SMF_TRACK_HEADER_SIZE;
+	return SMF_EVENT;
+}
+
+void smf_decoder_init(struct smf_decoder *d)
+{
+	memset(d, 0, sizeof(*d));
+}
+
+/* makes track bytes [base, base + len) available to the decoder */
+void smf_decoder_set_data(struct smf_decoder *d, const unsigned char *data,
+			  size_t base, size_t len)
+{
+	d->data = data;
+	d->base = base;
+	d->len = len;
+}
+
+/*
+ * Reads a variable-length quantity; returns the number of bytes used,
+ * SMF_NEED_MORE if it is cut off, or SMF_ERR_VLQ if it is longer than
+ * the four bytes the SMF specification allows.
+ */
+int smf_read_vlq(const unsigned char *p, size_t len, uint32_t *value)
+{
+	uint32_t v = 0;
+
+	for (size_t i = 0; i < 4; i++) {
+		if (i >= len)
+			return SMF_NEED_MORE;
+		v = v << 7 | (p[i] & 0x7f);
+		if (!(p[i] & 0x80)) {
+			*value = v;
+			return i + 1;
+		}
+	}
+	return SMF_ERR_VLQ;
+}
+
+/* number of data bytes of a channel message */
+int smf_message_length(unsigned char status)
+{
+	switch (status & 0xf0) {
+	case 0xc0:
+	case 0xd0:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/*
+ * Decodes the event at d->pos.  On SMF_NEED_MORE the state is unchanged,
+ * so decoding can be retried when more data is available.
+ */
+int smf_decode_event(struct smf_decoder *d, struct smf_event *ev)
+{
+	const unsigned char *p = d->data + (d->pos - d->base);
+	size_t avail = d->base + d->len - d->pos;
+	unsigned char status;
+	uint32_t delta, length;
+	size_t i;
+	int n;
+
+	if (d->ended)
+		return avail ? SMF_ERR_AFTER_END : SMF_NEED_MORE;
+
+	n = smf_read_vlq(p, avail, &delta);
+	if (n <= 0)
+		return n;
+	i = n;
+	if (i >= avail)
+		return SMF_NEED_MORE;
+
+	memset(ev, 0, sizeof(*ev));
+	if (p[i] & 0x80) {
+		status = p[i++];
+	} else {
+		if (!d->running_status)
+			return SMF_ERR_STATUS;
+		status = d->running_status;
+		ev->running = 1;
+	}
+
+	if (status < 0xf0) {
+		int count = smf_message_length(status);
+
+		if (i + count > avail)
+			return SMF_NEED_MORE;
+		for (int k = 0; k < count; k++) {
+			if (p[i] & 0x80)
+				return SMF_ERR_DATA;
+			ev->data[k] = p[i++];
+		}
+		d->running_status = status;
+	} else if (status == 0xf0 || status == 0xf7 || status == 0xff) {
+		if (status == 0xff) {
+			if (i >= avail)
+				return SMF_NEED_MORE;
+			if (p[i] & 0x80)
+				return SMF_ERR_META;
+			ev->type = p[i++];
+		}
+		n = smf_read_vlq(p + i, avail - i, &length);
+		if (n <= 0)
+			return n;
+		i += n;
+		if (length > avail - i)
+			return SMF_NEED_MORE;
+		if (status == 0xff && ev->type == SMF_META_END_OF_TRACK &&
+		    length != 0)
+			return SMF_ERR_META;
+		ev->payload = p + i;
+		ev->length = length;
+		i += length;
+		/* SysEx and meta events cancel running status */
+		d->running_status = 0;
+	} else {
+		/* system common and real-time messages cannot be stored */
+		return SMF_ERR_STATUS;
+	}
+
+	ev->status = status;
+	ev->delta = delta;
+	ev->offset = d->pos;
+	ev->size = i;
+	d->pos += i;
+	d->tick += delta;
+	ev->tick = d->tick;
+	if (status == 0xff && ev->type == SMF_META_END_OF_TRACK)
+		d->ended = 1;
+	return SMF_EVENT;
+}
+
+/*
+ * Returns the index of the first byte with the high bit set, or len if
+ * all are valid MIDI data bytes.  SysEx dumps are the bulk of most
+ * files by size, so this is done 16 or 8 bytes at a time.
+ */
+size_t smf_scan_data(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, p + i, 8);
+		if (w & 0x8080808080808080ULL)
+			break;
+	}
+#endif
+	for (; i < len; i++)
+		if (p[i] & 0x80)
+			break;
+	return i;
+}
+
+void smf_state_init(struct smf_state *s)
+{
+	for (int ch = 0; ch < 16; ch++) {
+		struct smf_channel_state *c = &s->channels[ch];
+
+		c->program = 0xff;
+		c->pressure = 0xff;
+		c->bend = 0xffff;
+		memset(c->controllers, 0xff, sizeof(c->controllers));
+		memset(c->notes, 0, sizeof(c->notes));
+	}
+}
+
+/* updates the state with one channel message */
+void smf_state_apply(struct smf_state *s, unsigned char status,
+		     const unsigned char *data)
+{
+	struct smf_channel_state *c = &s->channels[status & 0xf];
+
+	switch (status & 0xf0) {
+	case 0x80:
+		c->notes[data[0]] = 0;
+		break;
+	case 0x90:
+		c->notes[data[0]] = data[1];
+		break;
+	case 0xb0:
+		c->controllers[data[0]] = data[1];
+		/* all sound/notes off */
+		if (data[0] == 0x78 || (data[0] >= 0x7b && data[0] <= 0x7f))
+			memset(c->notes, 0, sizeof(c->notes));
+		break;
+	case 0xc0:
+		c->program = data[0];
+		break;
+	case 0xd0:
+		c->pressure = data[0];
+		break;
+	case 0xe0:
+		c->bend = data[0] | data[1] << 7;
+		break;
+	}
+}
+
+/* checks the division field of the MThd chunk */
+static int valid_division(int division)
+{
+	if (!(division & 0x8000))
+		return division != 0;
+	switch (0x100 - (division >> 8)) {
+	case 24:
+	case 25:
+	case 29:
+	case 30:
+		return (division & 0xff) != 0;
+	default:
+		return 0;
+	}
+}
+
+/* validates the events of one MTrk chunk */
+static int validate_track(const unsigned char *data, size_t len,
+			  size_t file_offset, struct smf_validation *result)
+{
+	struct smf_decoder d;
+	struct smf_event ev;
+	int err;
+
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, data, 0, len);
+	while ((err = smf_decode_event(&d, &ev)) == SMF_EVENT) {
+		result->events++;
+		/*
+		 * A complete F0 message ends with F7, which is not a data
+		 * byte.  F7 "escapes" may carry any bytes, so are not checked.
+		 */
+		if (ev.status == 0xf0) {
+			size_t n = ev.length;
+
+			if (n && ev.payload[n - 1] == 0xf7)
+				n--;
+			if (smf_scan_data(ev.payload, n) != n) {
+				err = SMF_ERR_SYSEX;
+				break;
+			}
+		}
+	}
+	if (d.tick > result->end_tick)
+		result->end_tick = d.tick;
+	if (err == SMF_NEED_MORE)
+		err = d.pos != len ? SMF_ERR_TRUNCATED :
+			!d.ended ? SMF_ERR_NO_END : 0;
+	if (err) {
+		result->error = err;
+		result->error_offset = file_offset +
+			(err == SMF_ERR_SYSEX ? ev.offset : d.pos);
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * Checks a complete file: the MThd chunk, the length of every MTrk
+ * chunk, and every event in them.  Unknown chunk types are skipped.
+ *
+ * With 'live', the file may be one that arecordmidi is still writing.
+ * Its last track then either ends with the provisional end-of-track
+ * (which is a valid file anyway), or, if a flush is in progress, with
+ * events that are cut off or not yet followed by an end-of-track; both
+ * are accepted and reported as in_progress.  Bytes after the last
+ * track's length belong to that flush and are ignored.
+ */
+int smf_validate(const unsigned char *buf, size_t len, int live,
+		 struct smf_validation *result)
+{
+	struct smf_header header;
+	size_t pos;
+	int err;
+
+	memset(result, 0, sizeof(*result));
+	err = smf_read_header(buf, len, &header);
+	if (err != SMF_EVENT || !valid_division(header.division) ||
+	    (header.format == 0 && header.tracks != 1)) {
+		result->error = err == SMF_EVENT || err == SMF_NEED_MORE ?
+			SMF_ERR_HEADER : err;
+		return result->error;
+	}
+
+	pos = header.track_offset - SMF_TRACK_HEADER_SIZE;
+	while (pos < len) {
+		uint32_t length;
+		int is_track;
+
+		if (len - pos < SMF_TRACK_HEADER_SIZE) {
+			result->error = SMF_ERR_TRUNCATED;
+			break;
+		}
+		is_track = !memcmp(buf + pos, "MTrk", 4);
+		length = read_32(buf + pos + 4);
+		pos += SMF_TRACK_HEADER_SIZE;
+		if (length > len - pos) {
+			if (!live || !is_track) {
+				result->error = SMF_ERR_TRUNCATED;
+				break;
+			}
+			/* the length was patched before the data reached us */
+			length = len - pos;
+		}
+		if (is_track) {
+			result->tracks++;
+			err = validate_track(buf + pos, length, pos, result);
+			if (err && live && result->tracks == header.tracks &&
+			    (err == SMF_ERR_TRUNCATED || err == SMF_ERR_NO_END)) {
+				result->error = 0;
+				result->in_progress = 1;
+				return 0;
+			}
+			if (err)
+				return err;
+		}
+		pos += length;
+		if (live && result->tracks == header.tracks)
+			break;
+	}
+	if (!result->error && result->tracks != header.tracks)
+		result->error = result->tracks < header.tracks ?
+			SMF_ERR_TRUNCATED : SMF_ERR_HEADER;
+	if (result->error)
+		result->error_offset = pos;
+	return result->error;
+}
+
+const char *smf_strerror(int err)
+{
+	switch (err) {
+	case SMF_NEED_MORE:
+		return "truncated data";
+	case SMF_ERR_HEADER:
+		return "invalid header";
+	case SMF_ERR_VLQ:
+		return "invalid variable-length quantity";
+	case SMF_ERR_STATUS:
+		return "invalid status byte";
+	case SMF_ERR_DATA:
+		return "invalid data byte";
+	case SMF_ERR_META:
+		return "invalid meta event";
+	case SMF_ERR_AFTER_END:
+		return "data after end of track";
+	case SMF_ERR_NO_END:
+		return "missing end of track";
+	case SMF_ERR_SYSEX:
+		return "invalid SysEx data";
+	case SMF_ERR_TRUNCATED:
+		return "file is truncated";
+	case SMF_ERR_IO:
+		return "read error";
+	case SMF_ERR_COMPRESSED:
+		return "compressed with zstd, decompress it with zstd -dc first";
+	default:
+		return "unknown error";
+	}
+}
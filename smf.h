@@ -0,0 +1,198 @@
+/*
+ * smf.h - minimal standard MIDI file decoder
+ *
+ * This is deliberately independent of the encoder in arecordmidi.c, so
+ * that it can be used to check what the encoder produced.
+ */
+
+#ifndef SMF_H
+#define SMF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SMF_HEADER_SIZE		14	/* "MThd", length, format, tracks, division */
+#define SMF_TRACK_HEADER_SIZE	8	/* "MTrk", length */
+
+/* return values of smf_decode_event() and smf_read_header() */
+#define SMF_EVENT		1	/* an event was decoded */
+#define SMF_NEED_MORE		0	/* the data ends inside the next event */
+#define SMF_ERR_HEADER		(-1)	/* not a MThd/MTrk chunk we understand */
+#define SMF_ERR_VLQ		(-2)	/* variable-length quantity too long */
+#define SMF_ERR_STATUS		(-3)	/* data byte without running status */
+#define SMF_ERR_DATA		(-4)	/* data byte with the high bit set */
+#define SMF_ERR_META		(-5)	/* malformed meta event */
+#define SMF_ERR_AFTER_END	(-6)	/* data after the end-of-track event */
+#define SMF_ERR_NO_END		(-7)	/* track without end-of-track event */
+#define SMF_ERR_SYSEX		(-8)	/* SysEx data byte with the high bit set */
+#define SMF_ERR_TRUNCATED	(-9)	/* file ends inside a chunk or event */
+#define SMF_ERR_IO		(-10)	/* read error, see errno */
+#define SMF_ERR_COMPRESSED	(-11)	/* a --zstd take: decompress it first */
+
+#define SMF_META_END_OF_TRACK	0x2f
+#define SMF_META_TEMPO		0x51
+#define SMF_META_TIME_SIGNATURE	0x58
+
+struct smf_header {
+	int format;
+	int tracks;
+	int division;		/* ticks per beat, or SMPTE format and ticks */
+	uint32_t track_length;	/* length of the first MTrk chunk */
+	size_t track_offset;	/* file offset of the first MTrk's data */
+};
+
+struct smf_event {
+	uint64_t tick;		/* absolute time */
+	uint32_t delta;
+	size_t offset;		/* track offset of the delta time */
+	size_t size;		/* size including the delta time */
+	unsigned char status;	/* 0x80-0xef, 0xf0/0xf7 for SysEx, 0xff for meta */
+	unsigned char type;	/* meta event type */
+	unsigned char running;	/* status byte was omitted */
+	unsigned char data[2];	/* channel message data bytes */
+	const unsigned char *payload;	/* SysEx or meta data */
+	uint32_t length;	/* of payload */
+};
+
+/*
+ * Decoder state.  Everything needed to continue decoding is in here,
+ * so a reader can save it, drop its buffer, and resume later with new
+ * data starting at 'pos'.
+ */
+struct smf_decoder {
+	const unsigned char *data;	/* track bytes starting at offset 'base' */
+	size_t base;
+	size_t len;
+	size_t pos;			/* track offset of the next event */
+	uint64_t tick;
+	unsigned char running_status;
+	unsigned char ended;		/* end-of-track seen */
+};
+
+/* what a player must know to start in the middle of a track */
+struct smf_channel_state {
+	unsigned char program;		/* 0xff: not set */
+	unsigned char pressure;		/* 0xff: not set */
+	unsigned short bend;		/* 0xffff: not set */
+	unsigned char controllers[128];	/* 0xff: not set */
+	unsigned char notes[128];	/* velocity of held notes, 0: off */
+};
+
+struct smf_state {
+	struct smf_channel_state channels[16];
+};
+
+/*
+ * The seek index arecordmidi writes next to a take (<file>.seek): this
+ * header, then points in increasing order of tick and offset.  Each
+ * point is an event boundary at which decoding can start, with the
+ * decoder and channel state there.
+ */
+#define SMF_SEEK_MAGIC		"ARMSEEK2"
+
+struct smf_seek_header {
+	char magic[8];
+	uint32_t point_size;
+	uint32_t division;
+};
+
+struct smf_seek_point {
+	uint64_t tick;			/* of the previous event */
+	uint32_t offset;		/* track offset of the next event */
+	unsigned char running_status;
+	unsigned char reserved[3];
+	struct smf_state state;
+};
+
+/*
+ * The columnar sidecar arecordmidi --columns writes next to a take
+ * (<file>.cols): this header, then a row group per flushed block.  A
+ * row is one MIDI message, as the decoder returns it.  A group is its
+ * header followed by its columns, each an array of 'rows' values: tick
+ * (uint64_t), type and channel (the status byte split, 0xf0 or 0xf7
+ * and 0 for SysEx), data1 and data2 (unsigned char), then payload and
+ * length (uint32_t, the track offset and size of SysEx data, else 0).
+ * Groups are padded to a multiple of 8 bytes, so every column is
+ * aligned in a mapped file.  Like the seek index, it is in the byte
+ * order of the recording host.
+ */
+#define SMF_COLS_MAGIC		"ARMCOLS1"
+#define SMF_COLS_ROW_SIZE	20	/* bytes of all columns of a row */
+
+struct smf_cols_header {
+	char magic[8];
+	uint32_t group_size;		/* of struct smf_cols_group */
+	uint32_t division;
+};
+
+struct smf_cols_group {
+	uint32_t rows;
+	uint32_t reserved;
+	uint64_t min_tick, max_tick;
+	unsigned char min[4], max[4];	/* of type, channel, data1, data2 */
+};
+
+/* the size of a row group, with its header and padding */
+#define SMF_COLS_GROUP_SIZE(rows) \
+	((sizeof(struct smf_cols_group) + (size_t)(rows) * SMF_COLS_ROW_SIZE + 7) & ~(size_t)7)
+
+/*
+ * The note index arecordmidi --notes writes next to a take
+ * (<file>.notes): this header, then a block per flush of the notes that
+ * ended in it, sorted by start.  A note on is paired with the next note
+ * off (or note on of velocity 0, or new note on) of its key and
+ * channel; notes still held at the end of the take end there, flagged.
+ * In the byte order of the recording host, like the seek index.
+ */
+#define SMF_NOTES_MAGIC		"ARMNOTE1"
+#define SMF_NOTE_HELD		0x01	/* not released before the end */
+
+struct smf_notes_header {
+	char magic[8];
+	uint32_t note_size;		/* of struct smf_note */
+	uint32_t division;
+};
+
+struct smf_notes_block {
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t min_start, max_end;	/* of its notes */
+};
+
+struct smf_note {
+	uint64_t start, end;		/* ticks */
+	unsigned char key;
+	unsigned char velocity;
+	unsigned char off_velocity;
+	unsigned char channel;		/* 0-15 */
+	unsigned char flags;
+	unsigned char reserved[3];
+};
+
+/* result of smf_validate() */
+struct smf_validation {
+	int error;		/* 0 or SMF_ERR_* */
+	size_t error_offset;	/* file offset of the bad event or chunk */
+	int tracks;		/* MTrk chunks checked */
+	unsigned long events;
+	uint64_t end_tick;	/* of the longest track */
+	int in_progress;	/* live: last track is still being written */
+};
+
+int smf_read_header(const unsigned char *buf, size_t len,
+		    struct smf_header *header);
+void smf_decoder_init(struct smf_decoder *d);
+void smf_decoder_set_data(struct smf_decoder *d, const unsigned char *data,
+			  size_t base, size_t len);
+int smf_decode_event(struct smf_decoder *d, struct smf_event *ev);
+int smf_read_vlq(const unsigned char *p, size_t len, uint32_t *value);
+int smf_message_length(unsigned char status);
+size_t smf_scan_data(const unsigned char *p, size_t len);
+void smf_state_init(struct smf_state *s);
+void smf_state_apply(struct smf_state *s, unsigned char status,
+		     const unsigned char *data);
+int smf_validate(const unsigned char *buf, size_t len, int live,
+		 struct smf_validation *result);
+const char *smf_strerror(int err);
+
+#endif
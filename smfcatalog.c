@@ -0,0 +1,417 @@
+/*
+ * smfcatalog.c - query the catalog of takes written by arecordmidi --catalog
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "version.h"
+#include "catalog.h"
+
+static const struct catalog_entry *entries;
+static uint32_t count;
+
+/* the query; a field that is not restricted has min > max */
+static struct {
+	int64_t port_min, port_max;
+	int64_t key_min, key_max;
+	int64_t duration_min, duration_max;	/* ms */
+	uint64_t since, until;			/* us since the epoch */
+	uint32_t min_notes;
+} query = {
+	1, 0, 1, 0, 0, INT64_MAX, 0, UINT64_MAX, 0
+};
+
+static void fatal(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+static int64_t order_value(int order, const struct catalog_entry *e)
+{
+	switch (order) {
+	case CATALOG_BY_PORT:
+		return e->client << 8 | e->port;
+	case CATALOG_BY_KEY:
+		return e->key;
+	default:
+		return e->duration_ms;
+	}
+}
+
+static int sort_order;
+
+static int compare_entries(const void *a, const void *b)
+{
+	uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+	int64_t x = order_value(sort_order, &entries[i]);
+	int64_t y = order_value(sort_order, &entries[j]);
+
+	if (x != y)
+		return x < y ? -1 : 1;
+	return i < j ? -1 : i > j;
+}
+
+static int compare_numbers(const void *a, const void *b)
+{
+	uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+
+	return i < j ? -1 : i > j;
+}
+
+/* whether an index file header was written for this catalog */
+static int same_catalog(const struct catalog_index_header *header,
+			const struct stat *st)
+{
+	if (header->entries > count || header->ino != (uint64_t)st->st_ino)
+		return 0;
+	return !header->entries ||
+		(header->first_start_us == entries[0].start_us &&
+		 header->last_end_us == entries[header->entries - 1].end_us);
+}
+
+/*
+ * Brings the secondary indexes up to date: the entries appended since
+ * the index file was written are sorted and merged into each order.
+ * Returns the CATALOG_ORDERS arrays of 'count' entry numbers.
+ */
+static uint32_t *load_index(const char *catalog, const struct stat *st)
+{
+	struct catalog_index_header header = { };
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	uint32_t *index, *old = NULL, *added, done = 0;
+	size_t size = (size_t)CATALOG_ORDERS * count * sizeof(uint32_t);
+	FILE *f;
+
+	index = malloc(size ? size : 1);
+	if (!index)
+		fatal("Out of memory");
+
+	snprintf(path, sizeof(path), "%s.idx", catalog);
+	f = fopen(path, "rb");
+	if (f) {
+		if (fread(&header, sizeof(header), 1, f) == 1 &&
+		    !memcmp(header.magic, CATALOG_INDEX_MAGIC, sizeof(header.magic)) &&
+		    same_catalog(&header, st)) {
+			done = header.entries;
+			old = malloc((size_t)CATALOG_ORDERS * done * sizeof(uint32_t) + 1);
+			if (!old || fread(old, sizeof(uint32_t),
+					  (size_t)CATALOG_ORDERS * done, f) !=
+			    (size_t)CATALOG_ORDERS * done)
+				done = 0;
+		}
+		fclose(f);
+	}
+	if (done == count) {
+		if (count)
+			memcpy(index, old, size);
+		free(old);
+		return index;
+	}
+
+	added = malloc((count - done) * sizeof(uint32_t));
+	if (!added)
+		fatal("Out of memory");
+	for (int order = 0; order < CATALOG_ORDERS; order++) {
+		uint32_t *out = index + (size_t)order * count;
+		uint32_t *prev = old + (size_t)order * done;
+		uint32_t i = 0, j = 0, k = 0;
+
+		/* sort the new entries, then merge them into the old order */
+		for (uint32_t n = done; n < count; n++)
+			added[n - done] = n;
+		sort_order = order;
+		qsort(added, count - done, sizeof(uint32_t), compare_entries);
+		while (i < done || j < count - done) {
+			if (j >= count - done ||
+			    (i < done && compare_entries(&prev[i], &added[j]) < 0))
+				out[k++] = prev[i++];
+			else
+				out[k++] = added[j++];
+		}
+	}
+	free(added);
+	free(old);
+
+	/* save it for next time; a read-only catalog just goes without */
+	header.entries = count;
+	header.ino = st->st_ino;
+	header.first_start_us = count ? entries[0].start_us : 0;
+	header.last_end_us = count ? entries[count - 1].end_us : 0;
+	memcpy(header.magic, CATALOG_INDEX_MAGIC, sizeof(header.magic));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (f) {
+		if (fwrite(&header, sizeof(header), 1, f) == 1 &&
+		    fwrite(index, 1, size, f) == size && !fclose(f))
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+	return index;
+}
+
+/* first position in 'order' whose value is >= v */
+static uint32_t lower_bound(const uint32_t *order, int o, int64_t v)
+{
+	uint32_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (order_value(o, &entries[order[mid]]) < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int matches(const struct catalog_entry *e)
+{
+	int64_t port = e->client << 8 | e->port;
+
+	if (query.port_min <= query.port_max &&
+	    (port < query.port_min || port > query.port_max))
+		return 0;
+	if (query.key_min <= query.key_max &&
+	    (e->key < query.key_min || e->key > query.key_max))
+		return 0;
+	return e->duration_ms >= query.duration_min &&
+		e->duration_ms <= query.duration_max &&
+		e->start_us >= query.since && e->start_us < query.until &&
+		e->notes >= query.min_notes;
+}
+
+static void print_entry(const struct catalog_entry *e)
+{
+	time_t t = e->start_us / 1000000;
+	char date[32];
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("%s %4u:%02u:%02u  %-9s %7u notes  %3d:%-3d %s\n", date,
+	       e->duration_ms / 3600000, e->duration_ms / 60000 % 60,
+	       e->duration_ms / 1000 % 60, catalog_key_name(e->key), e->notes,
+	       e->client, e->port, e->path);
+}
+
+/* runs the query through the access path with the fewest candidates */
+static void run_query(const uint32_t *index)
+{
+	uint32_t first = 0, last = count, *hits;
+	const uint32_t *candidates = NULL;
+	uint32_t nhits = 0;
+
+	/* end_us only grows, and a take ends after it starts */
+	if (query.since) {
+		uint32_t lo = 0, hi = count;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (entries[mid].end_us < query.since)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		first = lo;
+	}
+	for (int o = 0; o < CATALOG_ORDERS; o++) {
+		const uint32_t *order = index + (size_t)o * count;
+		int64_t min, max;
+		uint32_t lo, hi;
+
+		if (o == CATALOG_BY_PORT)
+			min = query.port_min, max = query.port_max;
+		else if (o == CATALOG_BY_KEY)
+			min = query.key_min, max = query.key_max;
+		else
+			min = query.duration_min, max = query.duration_max;
+		if (min > max || (o == CATALOG_BY_DURATION && !min &&
+				  max == INT64_MAX))
+			continue;
+		lo = lower_bound(order, o, min);
+		hi = max == INT64_MAX ? count : lower_bound(order, o, max + 1);
+		if (hi - lo < last - first) {
+			candidates = order;
+			first = lo;
+			last = hi;
+		}
+	}
+
+	hits = malloc((last - first) * sizeof(uint32_t) + 1);
+	if (!hits)
+		fatal("Out of memory");
+	for (uint32_t i = first; i < last; i++) {
+		uint32_t n = candidates ? candidates[i] : i;
+
+		if (matches(&entries[n]))
+			hits[nhits++] = n;
+	}
+	if (candidates)
+		qsort(hits, nhits, sizeof(uint32_t), compare_numbers);
+	for (uint32_t i = 0; i < nhits; i++)
+		print_entry(&entries[hits[i]]);
+	free(hits);
+}
+
+/* "2026-10-01", "2026-10-01 18:30", or relative: "7d", "12h", "30m" */
+static uint64_t parse_time(const char *arg)
+{
+	struct tm tm = { };
+	char *end;
+	long n;
+
+	n = strtol(arg, &end, 10);
+	if (end != arg && (!strcmp(end, "d") || !strcmp(end, "h") ||
+			   !strcmp(end, "m"))) {
+		long unit = *end == 'd' ? 86400 : *end == 'h' ? 3600 : 60;
+
+		return (uint64_t)(time(NULL) - n * unit) * 1000000;
+	}
+	end = strptime(arg, "%Y-%m-%d", &tm);
+	if (end && *end)
+		end = strptime(end, " %H:%M", &tm);
+	if (!end || *end)
+		fatal("Invalid time %s", arg);
+	tm.tm_isdst = -1;
+	return (uint64_t)mktime(&tm) * 1000000;
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] catalog\n"
+		"\nAvailable options:\n"
+		"  -h,--help                 this help\n"
+		"  -V,--version              show version\n"
+		"  -p,--port=client:port     recorded from this port\n"
+		"  -k,--key=key              in this key, e.g. \"C minor\" or F#m\n"
+		"  -d,--min-duration=s       at least this many seconds long\n"
+		"  -D,--max-duration=s       at most this many seconds long\n"
+		"  -s,--since=time           started at or after this time\n"
+		"  -u,--until=time           started before this time\n"
+		"  -n,--min-notes=n          with at least this many notes\n"
+		"\nTimes are YYYY-MM-DD [HH:MM] or relative to now: 7d, 12h, 30m.\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char short_options[] = "hVp:k:d:D:s:u:n:";
+	static const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"version", 0, NULL, 'V'},
+		{"port", 1, NULL, 'p'},
+		{"key", 1, NULL, 'k'},
+		{"min-duration", 1, NULL, 'd'},
+		{"max-duration", 1, NULL, 'D'},
+		{"since", 1, NULL, 's'},
+		{"until", 1, NULL, 'u'},
+		{"min-notes", 1, NULL, 'n'},
+		{ }
+	};
+	const struct catalog_header *header;
+	const char *catalog;
+	uint32_t *index;
+	struct stat st;
+	void *map;
+	int c, fd, client, port, key;
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help(argv[0]);
+			return 0;
+		case 'V':
+			fputs("smfcatalog version " SND_UTIL_VERSION_STR "\n", stderr);
+			return 0;
+		case 'p':
+			if (sscanf(optarg, "%d:%d", &client, &port) != 2)
+				fatal("Invalid port %s (use numbers, as in arecordmidi -l)", optarg);
+			query.port_min = query.port_max = client << 8 | port;
+			break;
+		case 'k':
+			key = catalog_parse_key(optarg);
+			if (key < 0)
+				fatal("Invalid key %s", optarg);
+			query.key_min = query.key_max = key;
+			break;
+		case 'd':
+			query.duration_min = atof(optarg) * 1000;
+			break;
+		case 'D':
+			query.duration_max = atof(optarg) * 1000;
+			break;
+		case 's':
+			query.since = parse_time(optarg);
+			break;
+		case 'u':
+			query.until = parse_time(optarg);
+			break;
+		case 'n':
+			query.min_notes = atoi(optarg);
+			break;
+		default:
+			help(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		help(argv[0]);
+		return 1;
+	}
+	catalog = argv[optind];
+
+	fd = open(catalog, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		fatal("Cannot open %s - %s", catalog, strerror(errno));
+	/* a consistent snapshot: appends happen under this lock */
+	flock(fd, LOCK_SH);
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header))
+		fatal("%s is not a catalog", catalog);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	flock(fd, LOCK_UN);
+	close(fd);
+	if (map == MAP_FAILED)
+		fatal("Cannot map %s - %s", catalog, strerror(errno));
+	header = map;
+	if (memcmp(header->magic, CATALOG_MAGIC, sizeof(header->magic)) ||
+	    header->entry_size != sizeof(struct catalog_entry))
+		fatal("%s is not a catalog", catalog);
+	entries = (const struct catalog_entry *)(header + 1);
+	count = (st.st_size - sizeof(*header)) / sizeof(struct catalog_entry);
+
+	index = load_index(catalog, &st);
+	run_query(index);
+	free(index);
+	munmap(map, st.st_size);
+	return 0;
+}
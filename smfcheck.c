@@ -0,0 +1,125 @@
+/*
+ * smfcheck.c - validate standard MIDI files, including ones being recorded
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "version.h"
+#include "smf.h"
+
+static int live;
+static int quiet;
+
+/* checks one file; returns 0 if it is valid */
+static int check_file(const char *filename)
+{
+	struct smf_validation result;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	if (!st.st_size) {
+		fprintf(stderr, "%s: empty file\n", filename);
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	err = smf_validate(map, st.st_size, live, &result);
+	munmap(map, st.st_size);
+
+	if (err) {
+		fprintf(stderr, "%s: %s at offset %zu\n", filename,
+			smf_strerror(err), result.error_offset);
+		return 1;
+	}
+	if (!quiet)
+		printf("%s: OK, %d track%s, %lu events, %llu ticks%s\n",
+		       filename, result.tracks, result.tracks == 1 ? "" : "s",
+		       result.events, (unsigned long long)result.end_tick,
+		       result.in_progress ? " (recording in progress)" : "");
+	return 0;
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] file...\n"
+		"\nAvailable options:\n"
+		"  -h,--help      this help\n"
+		"  -V,--version   show version\n"
+		"  -l,--live      accept files that are still being recorded\n"
+		"  -q,--quiet     report errors only\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char short_options[] = "hVlq";
+	static const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"version", 0, NULL, 'V'},
+		{"live", 0, NULL, 'l'},
+		{"quiet", 0, NULL, 'q'},
+		{ }
+	};
+	int c, failed = 0;
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help(argv[0]);
+			return 0;
+		case 'V':
+			fputs("smfcheck version " SND_UTIL_VERSION_STR "\n", stderr);
+			return 0;
+		case 'l':
+			live = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			help(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		help(argv[0]);
+		return 1;
+	}
+
+	for (; optind < argc; optind++)
+		failed |= check_file(argv[optind]);
+	return failed ? EXIT_FAILURE : 0;
+}
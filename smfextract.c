@@ -0,0 +1,406 @@
+/*
+ * smfextract.c - copy a time range of a take recorded by arecordmidi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Without a seek index the track is decoded from its start up to the
+ * beginning of the range.  With the <file>.seek that arecordmidi
+ * --seek-index writes, decoding starts at the last index point before
+ * the range, with the decoder and channel state stored there, so only
+ * up to one index interval has to be read.  The channel state at the
+ * start of the range (program, controllers, pitch bend, pressure and
+ * held notes) is written at its first tick, and the notes still held at
+ * its end are released there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "version.h"
+#include "smf.h"
+
+static FILE *out;
+static uint32_t out_size;
+static uint64_t out_tick;
+static unsigned char out_status;
+
+static void fatal(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+static void put(const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, out) != len)
+		fatal("Write error - %s", strerror(errno));
+	out_size += len;
+}
+
+static void put_vlq(uint32_t v)
+{
+	unsigned char buf[4];
+	int n = 0;
+
+	do
+		buf[3 - n++] = v & 0x7f;
+	while (v >>= 7);
+	for (int i = 4 - n; i < 3; i++)
+		buf[i] |= 0x80;
+	put(buf + 4 - n, n);
+}
+
+/* writes a channel message at 'tick' of the output, with running status */
+static void put_message(uint64_t tick, unsigned char status,
+			unsigned char d1, unsigned char d2)
+{
+	unsigned char data[2] = { d1, d2 };
+
+	put_vlq(tick - out_tick);
+	out_tick = tick;
+	if (status != out_status)
+		put(&status, 1);
+	out_status = status;
+	put(data, smf_message_length(status));
+}
+
+/* writes a SysEx or meta event */
+static void put_event(uint64_t tick, const struct smf_event *ev)
+{
+	put_vlq(tick - out_tick);
+	out_tick = tick;
+	put(&ev->status, 1);
+	if (ev->status == 0xff)
+		put(&ev->type, 1);
+	put_vlq(ev->length);
+	put(ev->payload, ev->length);
+	out_status = 0;
+}
+
+static void *map_file(const char *filename, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return map;
+}
+
+/*
+ * Maps <file>.seek and returns its points, or NULL if there is no usable
+ * index for this take.
+ */
+static const struct smf_seek_point *load_index(const char *filename,
+					       const struct smf_header *h,
+					       size_t *count)
+{
+	const struct smf_seek_header *sh;
+	char path[PATH_MAX];
+	size_t size;
+
+	snprintf(path, sizeof(path), "%s.seek", filename);
+	sh = map_file(path, &size);
+	if (!sh)
+		return NULL;
+	if (size < sizeof(*sh) ||
+	    memcmp(sh->magic, SMF_SEEK_MAGIC, sizeof(sh->magic)) ||
+	    sh->point_size != sizeof(struct smf_seek_point) ||
+	    sh->division != (uint32_t)h->division) {
+		fprintf(stderr, "%s: not a seek index for this file, ignored\n",
+			path);
+		return NULL;
+	}
+	*count = (size - sizeof(*sh)) / sizeof(struct smf_seek_point);
+	return (const struct smf_seek_point *)(sh + 1);
+}
+
+/* the last index point before 'tick', or NULL */
+static const struct smf_seek_point *find_point(const struct smf_seek_point *points,
+					       size_t count, uint64_t tick,
+					       uint32_t track_length)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (points[mid].tick < tick)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* skip points beyond the end, from a take that was cut short */
+	while (lo > 0 && points[lo - 1].offset > track_length)
+		lo--;
+	return lo ? &points[lo - 1] : NULL;
+}
+
+/* parses [[hh:]mm:]ss[.frac] */
+static double parse_time(const char *s)
+{
+	double t = 0, part;
+	char *end;
+
+	for (;;) {
+		part = strtod(s, &end);
+		if (end == s || part < 0)
+			fatal("Invalid time: %s", s);
+		t = t * 60 + part;
+		if (*end != ':')
+			break;
+		s = end + 1;
+	}
+	if (*end)
+		fatal("Invalid time: %s", s);
+	return t;
+}
+
+static uint64_t seconds_to_ticks(double seconds, int division, uint32_t tempo)
+{
+	if (division & 0x8000) {
+		int fps = 0x100 - (division >> 8);
+
+		return seconds * (fps == 29 ? 29.97 : fps) * (division & 0xff) + 0.5;
+	}
+	return seconds * 1e6 * division / tempo + 0.5;
+}
+
+/* writes the state a player needs at the start of the range */
+static void put_state(const struct smf_state *state)
+{
+	for (int ch = 0; ch < 16; ch++) {
+		const struct smf_channel_state *c = &state->channels[ch];
+
+		/* bank select before the program change */
+		for (int cc = 0x00; cc <= 0x20; cc += 0x20)
+			if (c->controllers[cc] != 0xff)
+				put_message(0, 0xb0 | ch, cc, c->controllers[cc]);
+		if (c->program != 0xff)
+			put_message(0, 0xc0 | ch, c->program, 0);
+		for (int cc = 0x01; cc < 0x78; cc++) {
+			/* data entry only makes sense after its parameter number */
+			if (cc == 0x20 || cc == 0x06 || cc == 0x26 ||
+			    (cc >= 0x60 && cc <= 0x65))
+				continue;
+			if (c->controllers[cc] != 0xff)
+				put_message(0, 0xb0 | ch, cc, c->controllers[cc]);
+		}
+		if (c->bend != 0xffff)
+			put_message(0, 0xe0 | ch, c->bend & 0x7f, c->bend >> 7);
+		if (c->pressure != 0xff)
+			put_message(0, 0xd0 | ch, c->pressure, 0);
+		for (int note = 0; note < 128; note++)
+			if (c->notes[note])
+				put_message(0, 0x90 | ch, note, c->notes[note]);
+	}
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] -o output input\n"
+		"\nAvailable options:\n"
+		"  -h,--help           this help\n"
+		"  -V,--version        show version\n"
+		"  -s,--start=time     start of the range (default: 0)\n"
+		"  -e,--end=time       end of the range (default: end of the take)\n"
+		"  -o,--output=file    file to write\n"
+		"\nTimes are [[hh:]mm:]ss[.frac] from the start of the take.\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char short_options[] = "hVs:e:o:";
+	static const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"version", 0, NULL, 'V'},
+		{"start", 1, NULL, 's'},
+		{"end", 1, NULL, 'e'},
+		{"output", 1, NULL, 'o'},
+		{ }
+	};
+	const char *output = NULL, *input;
+	double start = 0, end = -1;
+	const unsigned char *map, *track;
+	const struct smf_seek_point *points, *point = NULL;
+	struct smf_header header;
+	struct smf_decoder d;
+	struct smf_event ev;
+	struct smf_state state;
+	uint64_t start_tick, end_tick, final_tick;
+	uint32_t tempo = 500000;
+	unsigned char length[4];
+	size_t size, count = 0;
+	int c, err;
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help(argv[0]);
+			return 0;
+		case 'V':
+			fputs("smfextract version " SND_UTIL_VERSION_STR "\n", stderr);
+			return 0;
+		case 's':
+			start = parse_time(optarg);
+			break;
+		case 'e':
+			end = parse_time(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			help(argv[0]);
+			return 1;
+		}
+	}
+	if (!output || optind != argc - 1) {
+		help(argv[0]);
+		return 1;
+	}
+	input = argv[optind];
+	if (end >= 0 && end <= start)
+		fatal("The end of the range must be after its start");
+
+	map = map_file(input, &size);
+	if (!map)
+		fatal("Cannot map %s - %s", input, strerror(errno));
+	err = smf_read_header(map, size, &header);
+	if (err != SMF_EVENT || header.format != 0 || header.tracks != 1)
+		fatal("%s: not a single-track MIDI file", input);
+	if (header.track_length > size - header.track_offset)
+		header.track_length = size - header.track_offset;
+	track = map + header.track_offset;
+
+	out = fopen(output, "wb");
+	if (!out)
+		fatal("Cannot open %s - %s", output, strerror(errno));
+	/* the header and MTrk id of the input, length patched later */
+	if (fwrite(map, 1, header.track_offset, out) != header.track_offset)
+		fatal("Write error - %s", strerror(errno));
+
+	/* arecordmidi writes its tempo and time signature at tick 0 only */
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, track, 0, header.track_length);
+	while (smf_decode_event(&d, &ev) == SMF_EVENT && ev.tick == 0 &&
+	       ev.status == 0xff && ev.type != SMF_META_END_OF_TRACK) {
+		if (ev.type == SMF_META_TEMPO && ev.length == 3)
+			tempo = ev.payload[0] << 16 | ev.payload[1] << 8 |
+				ev.payload[2];
+		if (ev.type == SMF_META_TEMPO ||
+		    ev.type == SMF_META_TIME_SIGNATURE)
+			put_event(0, &ev);
+	}
+	if (!tempo)
+		fatal("%s: invalid tempo", input);
+	start_tick = seconds_to_ticks(start, header.division, tempo);
+	end_tick = end < 0 ? UINT64_MAX :
+		seconds_to_ticks(end, header.division, tempo);
+
+	/* start decoding at the last index point before the range */
+	smf_state_init(&state);
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, track, 0, header.track_length);
+	points = load_index(input, &header, &count);
+	if (points)
+		point = find_point(points, count, start_tick, header.track_length);
+	if (point) {
+		d.pos = point->offset;
+		d.tick = point->tick;
+		d.running_status = point->running_status;
+		state = point->state;
+	}
+
+	/* catch up with the state at the start of the range */
+	while ((err = smf_decode_event(&d, &ev)) == SMF_EVENT &&
+	       ev.tick < start_tick && !d.ended)
+		if (ev.status < 0xf0)
+			smf_state_apply(&state, ev.status, ev.data);
+	if (err != SMF_EVENT)
+		goto decode_error;
+	put_state(&state);
+
+	/* the range itself */
+	final_tick = start_tick;
+	for (; err == SMF_EVENT; err = smf_decode_event(&d, &ev)) {
+		if (ev.tick >= end_tick) {
+			final_tick = end_tick;
+			break;
+		}
+		if (ev.tick > start_tick)
+			final_tick = ev.tick;
+		if (d.ended)
+			break;
+		if (ev.status < 0xf0) {
+			put_message(ev.tick - start_tick, ev.status,
+				    ev.data[0], ev.data[1]);
+			smf_state_apply(&state, ev.status, ev.data);
+		} else if (ev.status != 0xff || ev.tick > 0 ||
+			   (ev.type != SMF_META_TEMPO &&
+			    ev.type != SMF_META_TIME_SIGNATURE)) {
+			put_event(ev.tick - start_tick, &ev);
+		}
+	}
+	if (err != SMF_EVENT)
+		goto decode_error;
+
+	/* release what is still held, then end the track */
+	for (int ch = 0; ch < 16; ch++)
+		for (int note = 0; note < 128; note++)
+			if (state.channels[ch].notes[note])
+				put_message(final_tick - start_tick, 0x80 | ch,
+					    note, 0);
+	put_vlq(final_tick - start_tick - out_tick);
+	put("\xff\x2f\x00", 3);
+
+	length[0] = out_size >> 24;
+	length[1] = out_size >> 16;
+	length[2] = out_size >> 8;
+	length[3] = out_size;
+	if (fseek(out, header.track_offset - 4, SEEK_SET) ||
+	    fwrite(length, 1, 4, out) != 4 || fclose(out))
+		fatal("Cannot write %s - %s", output, strerror(errno));
+	return 0;
+
+decode_error:
+	fatal("%s: %s at track offset %zu", input,
+	      smf_strerror(err ? err : SMF_ERR_NO_END), d.pos);
+	return 1;
+}
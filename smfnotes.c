@@ -0,0 +1,223 @@
+/*
+ * smfnotes.c - query the note index of a take recorded by arecordmidi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * The <file>.notes that arecordmidi --notes writes is mapped, and each
+ * block whose notes all start after the range or end before it is
+ * skipped.  A note ends in the block of the flush that ended it, so the
+ * notes are sorted within a block but not across blocks; the matches
+ * are sorted by start before they are printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "version.h"
+#include "smf.h"
+
+static const char *const key_names[] = {
+	"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
+};
+
+static void fatal(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+static void *map_file(const char *filename, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return map;
+}
+
+static int by_start(const void *a, const void *b)
+{
+	const struct smf_note *x = *(const struct smf_note *const *)a;
+	const struct smf_note *y = *(const struct smf_note *const *)b;
+
+	if (x->start != y->start)
+		return (x->start > y->start) - (x->start < y->start);
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] file.notes\n"
+		"\nAvailable options:\n"
+		"  -h,--help           this help\n"
+		"  -V,--version        show version\n"
+		"  -s,--start=tick     notes sounding from this tick (default: 0)\n"
+		"  -e,--end=tick       notes sounding before this tick (default: end of the take)\n"
+		"  -k,--key=n          only this key (0-127)\n"
+		"  -c,--channel=n      only notes on this channel (1-16)\n"
+		"  -l,--min-length=n   only notes of at least n ticks\n"
+		"  -n,--count          print the number of notes only\n"
+		"\nPrints start, end, channel, key and velocities of each note, in order of\n"
+		"start; notes still held at the end of the take are marked \"held\".\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char short_options[] = "hVs:e:k:c:l:n";
+	static const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"version", 0, NULL, 'V'},
+		{"start", 1, NULL, 's'},
+		{"end", 1, NULL, 'e'},
+		{"key", 1, NULL, 'k'},
+		{"channel", 1, NULL, 'c'},
+		{"min-length", 1, NULL, 'l'},
+		{"count", 0, NULL, 'n'},
+		{ }
+	};
+	uint64_t start = 0, end = UINT64_MAX, min_length = 0;
+	const struct smf_note **matches = NULL;
+	size_t count = 0, alloc = 0;
+	unsigned long notes = 0, blocks = 0, scanned = 0;
+	const struct smf_notes_header *h;
+	const unsigned char *map;
+	int key = -1, channel = -1, count_only = 0;
+	size_t size, pos;
+	int c;
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help(argv[0]);
+			return 0;
+		case 'V':
+			fputs("smfnotes version " SND_UTIL_VERSION_STR "\n", stderr);
+			return 0;
+		case 's':
+			start = strtoull(optarg, NULL, 0);
+			break;
+		case 'e':
+			end = strtoull(optarg, NULL, 0);
+			break;
+		case 'k':
+			key = atoi(optarg);
+			if (key < 0 || key > 127)
+				fatal("Invalid key %s", optarg);
+			break;
+		case 'c':
+			channel = atoi(optarg) - 1;
+			if (channel < 0 || channel > 15)
+				fatal("Invalid channel %s", optarg);
+			break;
+		case 'l':
+			min_length = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			count_only = 1;
+			break;
+		default:
+			help(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		help(argv[0]);
+		return 1;
+	}
+
+	map = map_file(argv[optind], &size);
+	if (!map)
+		fatal("Cannot map %s - %s", argv[optind], strerror(errno));
+	h = (const struct smf_notes_header *)map;
+	if (size < sizeof(*h) || memcmp(h->magic, SMF_NOTES_MAGIC, sizeof(h->magic)) ||
+	    h->note_size != sizeof(struct smf_note))
+		fatal("%s: not a note index", argv[optind]);
+
+	for (pos = sizeof(*h); pos + sizeof(struct smf_notes_block) <= size;
+	     pos += sizeof(struct smf_notes_block) +
+		    ((const struct smf_notes_block *)(map + pos))->count *
+		    sizeof(struct smf_note)) {
+		const struct smf_notes_block *b = (const void *)(map + pos);
+		const struct smf_note *n = (const void *)(b + 1);
+
+		/* a take that was cut short may end inside a block */
+		if (b->count > (size - pos - sizeof(*b)) / sizeof(*n))
+			break;
+		blocks++;
+		notes += b->count;
+		/* a note sounds in [start, end); a held one up to its end */
+		if (b->min_start >= end || b->max_end < start)
+			continue;
+		scanned++;
+		for (uint32_t i = 0; i < b->count; i++) {
+			/* sorted by start */
+			if (n[i].start >= end)
+				break;
+			if ((n[i].end <= start && n[i].start < start) ||
+			    n[i].end - n[i].start < min_length ||
+			    (key >= 0 && n[i].key != key) ||
+			    (channel >= 0 && n[i].channel != channel))
+				continue;
+			if (count == alloc) {
+				alloc = alloc ? alloc * 2 : 4096;
+				matches = realloc(matches, alloc * sizeof(*matches));
+				if (!matches)
+					fatal("Out of memory");
+			}
+			matches[count++] = &n[i];
+		}
+	}
+
+	if (count_only) {
+		printf("%zu of %lu notes, %lu of %lu blocks read\n",
+		       count, notes, scanned, blocks);
+		return 0;
+	}
+	qsort(matches, count, sizeof(*matches), by_start);
+	for (size_t i = 0; i < count; i++) {
+		const struct smf_note *n = matches[i];
+
+		printf("%llu %llu %d %s%d %d %d%s\n",
+		       (unsigned long long)n->start, (unsigned long long)n->end,
+		       n->channel + 1, key_names[n->key % 12], n->key / 12 - 1,
+		       n->velocity, n->off_velocity,
+		       n->flags & SMF_NOTE_HELD ? " held" : "");
+	}
+	return 0;
+}
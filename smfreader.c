@@ -0,0 +1,187 @@
+/*
+ * smfreader.c - follow a standard MIDI file while arecordmidi records it
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * arecordmidi appends events, writes a provisional end-of-track after
+ * them, and then patches the MTrk length.  The reader remembers where
+ * it stopped decoding and, whenever inotify says the file changed,
+ * reads only the bytes between there and the current MTrk length.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "smfreader.h"
+
+int smf_reader_open(struct smf_reader *r, const char *filename)
+{
+	memset(r, 0, sizeof(*r));
+	smf_decoder_init(&r->decoder);
+	r->inotify_fd = -1;
+	r->fd = open(filename, O_RDONLY);
+	if (r->fd < 0)
+		return -errno;
+	r->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (r->inotify_fd < 0 ||
+	    inotify_add_watch(r->inotify_fd, filename,
+			      IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+		int err = -errno;
+
+		smf_reader_close(r);
+		return err;
+	}
+	return 0;
+}
+
+void smf_reader_close(struct smf_reader *r)
+{
+	if (r->inotify_fd >= 0)
+		close(r->inotify_fd);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->buf);
+	r->buf = NULL;
+	r->fd = r->inotify_fd = -1;
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? SMF_ERR_IO : SMF_NEED_MORE;
+		buf = (char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+	return SMF_EVENT;
+}
+
+/* reads the committed bytes that have not been decoded yet */
+static int update(struct smf_reader *r)
+{
+	unsigned char b[64];
+	uint32_t length, limit;
+	size_t pos, n;
+	int err;
+
+	if (!r->have_header) {
+		ssize_t got = pread(r->fd, b, sizeof(b), 0);
+
+		if (got < 0)
+			return SMF_ERR_IO;
+		err = smf_read_header(b, got, &r->header);
+		if (err != SMF_EVENT)
+			return err;
+		r->have_header = 1;
+	}
+
+	err = read_at(r->fd, b, 4, r->header.track_offset - 4);
+	if (err != SMF_EVENT)
+		return err;
+	length = (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+	pos = r->decoder.pos;
+	if (length < pos) {
+		/* the file was rewritten from scratch */
+		smf_decoder_init(&r->decoder);
+		r->have_header = 0;
+		return SMF_NEED_MORE;
+	}
+	r->length = length;
+
+	limit = length;
+	if (!r->closed)
+		limit = length > SMF_READER_UNSTABLE ?
+			length - SMF_READER_UNSTABLE : 0;
+	if (limit <= pos)
+		return SMF_NEED_MORE;
+
+	n = limit - pos;
+	if (n > r->buf_size) {
+		unsigned char *buf = realloc(r->buf, n);
+
+		if (!buf)
+			return SMF_ERR_IO;
+		r->buf = buf;
+		r->buf_size = n;
+	}
+	err = read_at(r->fd, r->buf, n, r->header.track_offset + pos);
+	if (err != SMF_EVENT)
+		return err == SMF_NEED_MORE ? SMF_ERR_TRUNCATED : err;
+	smf_decoder_set_data(&r->decoder, r->buf, pos, n);
+	return SMF_EVENT;
+}
+
+/*
+ * Returns the next committed event (SMF_EVENT), SMF_NEED_MORE when
+ * everything written so far has been returned, or an error.  The
+ * event's payload stays valid until the next call.  The end-of-track
+ * event is only returned once the writer has closed the file.
+ */
+int smf_reader_next(struct smf_reader *r, struct smf_event *ev)
+{
+	for (int updated = 0;; updated = 1) {
+		struct smf_decoder saved = r->decoder;
+		int err = r->decoder.data ?
+			smf_decode_event(&r->decoder, ev) : SMF_NEED_MORE;
+
+		if (err == SMF_EVENT && ev->status == 0xff &&
+		    ev->type == SMF_META_END_OF_TRACK && !r->closed) {
+			/* provisional; the next flush overwrites it */
+			r->decoder = saved;
+			err = SMF_NEED_MORE;
+		}
+		if (err != SMF_NEED_MORE || updated || r->decoder.ended)
+			return err;
+		err = update(r);
+		if (err != SMF_EVENT)
+			return err;
+	}
+}
+
+/*
+ * Waits up to 'timeout' milliseconds (-1: forever) for the file to
+ * change.  Returns 1 if it did, 0 on timeout, or -errno.
+ */
+int smf_reader_wait(struct smf_reader *r, int timeout)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = r->inotify_fd, .events = POLLIN };
+	int changed = 0;
+	ssize_t n;
+
+	if (r->closed)
+		return 0;
+	if (poll(&pfd, 1, timeout) < 0)
+		return -errno;
+	while ((n = read(r->inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n;) {
+			struct inotify_event *ie = (struct inotify_event *)p;
+
+			if (ie->mask & IN_CLOSE_WRITE)
+				r->closed = 1;
+			changed = 1;
+			p += sizeof(*ie) + ie->len;
+		}
+	}
+	return changed;
+}
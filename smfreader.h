@@ -0,0 +1,48 @@
+/*
+ * smfreader.h - follow a standard MIDI file while arecordmidi records it
+ */
+
+#ifndef SMFREADER_H
+#define SMFREADER_H
+
+#include "smf.h"
+
+/*
+ * arecordmidi may be overwriting its provisional end-of-track with new
+ * events at any moment, so the last bytes before the MTrk length are
+ * not decoded until the length moves on or the file is closed.  This
+ * covers the largest end-of-track it writes: a four-byte delta and
+ * FF 2F 00.
+ */
+#define SMF_READER_UNSTABLE	8
+
+struct smf_reader {
+	int fd;
+	int inotify_fd;
+	int closed;		/* writer closed the file; its end is final */
+	int have_header;
+	struct smf_header header;
+	struct smf_decoder decoder;	/* where to continue decoding */
+	uint32_t length;	/* MTrk length at the last update */
+	unsigned char *buf;	/* committed bytes not yet decoded */
+	size_t buf_size;
+};
+
+int smf_reader_open(struct smf_reader *r, const char *filename);
+void smf_reader_close(struct smf_reader *r);
+int smf_reader_next(struct smf_reader *r, struct smf_event *ev);
+int smf_reader_wait(struct smf_reader *r, int timeout);
+
+/* for poll()ing many readers at once; then call smf_reader_wait(r, 0) */
+static inline int smf_reader_fd(const struct smf_reader *r)
+{
+	return r->inotify_fd;
+}
+
+/* the final end-of-track has been returned */
+static inline int smf_reader_finished(const struct smf_reader *r)
+{
+	return r->decoder.ended;
+}
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * smfsplice.c - join consecutive takes recorded by arecordmidi into one file
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * The events of each take are copied byte for byte.  Only the first
+ * delta time of each take is rewritten, to place it on the common
+ * timeline using the start time in its .summary sidecar; a status byte
+ * is added there if the take began with running status; and the end of
+ * track events between the takes are dropped.  Leading tempo and time
+ * signature events that repeat the first take's are dropped as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "version.h"
+#include "smf.h"
+
+struct take {
+	const char *filename;
+	const unsigned char *map;
+	size_t map_size;
+	struct smf_header header;
+	const unsigned char *track;	/* MTrk data */
+	size_t end_offset;		/* track offset of the end-of-track */
+	uint64_t end_tick;
+	unsigned long long start_us;	/* 0 if unknown */
+	uint32_t tempo;			/* us per quarter note */
+};
+
+static FILE *out;
+static uint32_t out_size;
+
+static void fatal(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+static void put(const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, out) != len)
+		fatal("Write error - %s", strerror(errno));
+	out_size += len;
+}
+
+static void put_vlq(uint32_t v)
+{
+	unsigned char buf[4];
+	int n = 0;
+
+	if (v > 0x0fffffff)
+		fatal("Gap between takes too long for one delta time");
+	do
+		buf[3 - n++] = v & 0x7f;
+	while (v >>= 7);
+	for (int i = 4 - n; i < 3; i++)
+		buf[i] |= 0x80;
+	put(buf + 4 - n, n);
+}
+
+/* reads start_us from the take's .summary sidecar */
+static unsigned long long read_start(const char *filename)
+{
+	char path[PATH_MAX], line[256];
+	unsigned long long start = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s.summary", filename);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "start_us: %llu", &start) == 1)
+			break;
+	fclose(f);
+	return start;
+}
+
+/* maps a take and finds its end-of-track event */
+static void open_take(struct take *t)
+{
+	struct smf_decoder d;
+	struct smf_event ev;
+	struct stat st;
+	int fd, err;
+
+	fd = open(t->filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		fatal("Cannot open %s - %s", t->filename, strerror(errno));
+	t->map_size = st.st_size;
+	t->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (t->map == MAP_FAILED)
+		fatal("Cannot map %s - %s", t->filename, strerror(errno));
+
+	err = smf_read_header(t->map, t->map_size, &t->header);
+	if (err != SMF_EVENT || t->header.format != 0 || t->header.tracks != 1)
+		fatal("%s: not a single-track MIDI file", t->filename);
+	if (t->header.track_length > t->map_size - t->header.track_offset)
+		fatal("%s: file is truncated", t->filename);
+	t->track = t->map + t->header.track_offset;
+
+	t->tempo = 500000;
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, t->track, 0, t->header.track_length);
+	while ((err = smf_decode_event(&d, &ev)) == SMF_EVENT) {
+		if (ev.status == 0xff && ev.type == SMF_META_TEMPO &&
+		    ev.length == 3 && ev.tick == 0)
+			t->tempo = ev.payload[0] << 16 | ev.payload[1] << 8 |
+				ev.payload[2];
+		if (d.ended)
+			break;
+	}
+	if (err != SMF_EVENT)
+		fatal("%s: %s at track offset %zu", t->filename,
+		      smf_strerror(err ? err : SMF_ERR_NO_END), d.pos);
+	t->end_offset = ev.offset;
+	t->end_tick = ev.tick;
+	t->start_us = read_start(t->filename);
+}
+
+/* converts microseconds to ticks of the given division and tempo */
+static uint64_t us_to_ticks(unsigned long long us, int division, uint32_t tempo)
+{
+	if (division & 0x8000) {
+		int fps = 0x100 - (division >> 8);
+		double rate = (fps == 29 ? 29.97 : fps) * (division & 0xff);
+
+		return us * rate / 1e6 + 0.5;
+	}
+	return ((double)us * division) / tempo + 0.5;
+}
+
+/*
+ * Whether an event at the start of a later take only repeats the
+ * tempo or time signature that the first take already set.
+ */
+static int repeats_setup(const struct take *first, const struct smf_event *ev)
+{
+	struct smf_decoder d;
+	struct smf_event e;
+
+	if (ev->tick != 0 || ev->status != 0xff ||
+	    (ev->type != SMF_META_TEMPO && ev->type != SMF_META_TIME_SIGNATURE))
+		return 0;
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, first->track, 0, first->end_offset);
+	while (smf_decode_event(&d, &e) == SMF_EVENT && e.tick == 0)
+		if (e.status == 0xff && e.type == ev->type &&
+		    e.length == ev->length &&
+		    !memcmp(e.payload, ev->payload, ev->length))
+			return 1;
+	return 0;
+}
+
+/* copies a take's events, re-timing its first one */
+static void splice_take(const struct take *first, const struct take *t,
+			uint64_t start_tick, uint64_t *last_tick, int is_first)
+{
+	struct smf_decoder d;
+	struct smf_event ev;
+	int err;
+
+	smf_decoder_init(&d);
+	smf_decoder_set_data(&d, t->track, 0, t->end_offset);
+	while ((err = smf_decode_event(&d, &ev)) == SMF_EVENT) {
+		size_t skip;
+
+		if (!is_first && repeats_setup(first, &ev))
+			continue;
+
+		/* the first event: new delta time, explicit status */
+		put_vlq(start_tick + ev.tick - *last_tick);
+		skip = ev.offset;
+		while (t->track[skip] & 0x80)	/* the old delta time */
+			skip++;
+		skip++;
+		if (ev.running)
+			put(&ev.status, 1);
+		put(t->track + skip, t->end_offset - skip);
+		break;
+	}
+	if (err != SMF_EVENT && err != SMF_NEED_MORE)
+		fatal("%s: %s", t->filename, smf_strerror(err));
+
+	/* the rest is copied as it is; find the tick of the last event */
+	if (err == SMF_EVENT) {
+		while (smf_decode_event(&d, &ev) == SMF_EVENT)
+			;
+		*last_tick = start_tick + d.tick;
+	}
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] -o output take1 take2...\n"
+		"\nAvailable options:\n"
+		"  -h,--help           this help\n"
+		"  -V,--version        show version\n"
+		"  -o,--output=file    file to write\n"
+		"\nTakes are placed by the start_us in their .summary sidecars;\n"
+		"a take without one follows the previous take directly.\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char short_options[] = "hVo:";
+	static const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"version", 0, NULL, 'V'},
+		{"output", 1, NULL, 'o'},
+		{ }
+	};
+	const char *output = NULL;
+	struct take *takes;
+	uint64_t start_tick = 0, last_tick = 0, end_tick = 0;
+	unsigned char length[4];
+	int c, count;
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help(argv[0]);
+			return 0;
+		case 'V':
+			fputs("smfsplice version " SND_UTIL_VERSION_STR "\n", stderr);
+			return 0;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			help(argv[0]);
+			return 1;
+		}
+	}
+	count = argc - optind;
+	if (!output || count < 1) {
+		help(argv[0]);
+		return 1;
+	}
+
+	takes = calloc(count, sizeof(*takes));
+	if (!takes)
+		fatal("Out of memory");
+	for (int i = 0; i < count; i++) {
+		takes[i].filename = argv[optind + i];
+		open_take(&takes[i]);
+		if (takes[i].header.division != takes[0].header.division)
+			fatal("%s: different time division than %s",
+			      takes[i].filename, takes[0].filename);
+	}
+
+	out = fopen(output, "wb");
+	if (!out)
+		fatal("Cannot open %s - %s", output, strerror(errno));
+	/* the header and MTrk id of the first take, length patched later */
+	if (fwrite(takes[0].map, 1, takes[0].header.track_offset, out) !=
+	    takes[0].header.track_offset)
+		fatal("Write error - %s", strerror(errno));
+
+	for (int i = 0; i < count; i++) {
+		struct take *t = &takes[i];
+
+		if (i > 0) {
+			if (t->start_us && takes[0].start_us) {
+				unsigned long long us = t->start_us > takes[0].start_us ?
+					t->start_us - takes[0].start_us : 0;
+
+				start_tick = us_to_ticks(us, t->header.division,
+							 takes[0].tempo);
+			} else {
+				fprintf(stderr, "%s: no start time, placing it after %s\n",
+					t->filename, takes[i - 1].filename);
+				start_tick = end_tick;
+			}
+			if (start_tick < end_tick) {
+				fprintf(stderr, "%s: overlaps %s, moved to its end\n",
+					t->filename, takes[i - 1].filename);
+				start_tick = end_tick;
+			}
+		}
+		splice_take(&takes[0], t, start_tick, &last_tick, i == 0);
+		end_tick = start_tick + t->end_tick;
+	}
+
+	/* one end-of-track, at the end of the last take */
+	put_vlq(end_tick - last_tick);
+	put("\xff\x2f\x00", 3);
+
+	length[0] = out_size >> 24;
+	length[1] = out_size >> 16;
+	length[2] = out_size >> 8;
+	length[3] = out_size;
+	if (fseek(out, takes[0].header.track_offset - 4, SEEK_SET) ||
+	    fwrite(length, 1, 4, out) != 4 || fclose(out))
+		fatal("Cannot write %s - %s", output, strerror(errno));
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * smftail.c - print the events of a MIDI file while it is being recorded
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "version.h"
+#include "smfreader.h"
+
+static void print_event(const struct smf_event *ev)
+{
+	printf("%10llu  ", (unsigned long long)ev->tick);
+	if (ev->status < 0xf0) {
+		printf("%02x %02x", ev->status, ev->data[0]);
+		if (smf_message_length(ev->status) > 1)
+			printf(" %02x", ev->data[1]);
+		putchar('\n');
+	} else if (ev->status == 0xff) {
+		printf("meta %02x, %u bytes\n", ev->type, ev->length);
+	} else {
+		printf("sysex %02x, %u bytes\n", ev->status, ev->length);
+	}
+}
+
+static void help(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] file\n"
+		"\nAvailable options:\n"
+		"  -h,--help        this help\n"
+		"  -V,--version     show version\n"
+		"  -n,--no-follow   print what has been recorded, then exit\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char short_options[] = "hVn";
+	static const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"version", 0, NULL, 'V'},
+		{"no-follow", 0, NULL, 'n'},
+		{ }
+	};
+	struct smf_reader r;
+	struct smf_event ev;
+	int c, err, follow = 1;
+
+	while ((c = getopt_long(argc, argv, short_options,
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help(argv[0]);
+			return 0;
+		case 'V':
+			fputs("smftail version " SND_UTIL_VERSION_STR "\n", stderr);
+			return 0;
+		case 'n':
+			follow = 0;
+			break;
+		default:
+			help(argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		help(argv[0]);
+		return 1;
+	}
+
+	err = smf_reader_open(&r, argv[optind]);
+	if (err < 0) {
+		fprintf(stderr, "Cannot open %s - %s\n", argv[optind], strerror(-err));
+		return 1;
+	}
+	/* without following, treat the file as finished */
+	r.closed = !follow;
+
+	for (;;) {
+		while ((err = smf_reader_next(&r, &ev)) == SMF_EVENT)
+			print_event(&ev);
+		fflush(stdout);
+		if (err < 0) {
+			fprintf(stderr, "%s: %s at track offset %zu\n",
+				argv[optind], smf_strerror(err), r.decoder.pos);
+			break;
+		}
+		if (smf_reader_finished(&r) || r.closed)
+			break;
+		err = smf_reader_wait(&r, -1);
+		if (err < 0) {
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+			break;
+		}
+	}
+	smf_reader_close(&r);
+	return err < 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Records a month of virtual time from a MIDI file in seconds, once as a
+# single take and once with a take per 10 minutes of silence, and checks
+# every file.  For each virtual day the recorder prints its CPU time per
+# event, resident memory and open files, which should stay flat: a run
+# fails when on its last day any of them is over the first day's by
+# more than the margins below.
+# At 9600 ticks per beat the 32-bit queue tick wraps every 2.6 days, and
+# a pause of 4 hours needs more than one delta time.
+#
+#   ./soak.sh input.mid [days]
+input=${1:?usage: $0 input.mid [days]}
+days=${2:-30}
+rss_margin=10		# percent
+ns_margin=50		# percent, CPU time is noisy
+fd_margin=2		# a take and its sidecars may be open on one day only
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# compares the last "Replay: day" line of a log with the first
+check_drift() {
+	awk -v rss_margin=$rss_margin -v ns_margin=$ns_margin \
+	    -v fd_margin=$fd_margin -v run="$2" '
+	/^Replay: day / {
+		ns = $6; rss = $9; fds = $11
+		if (!n++) { ns1 = ns; rss1 = rss; fds1 = fds }
+	}
+	END {
+		if (n < 2) {
+			print run ": fewer than two days reported"
+			exit 1
+		}
+		printf "%s: day 1 %d ns/event, %d KiB, %d fds; last day %d ns/event, %d KiB, %d fds\n",
+			run, ns1, rss1, fds1, ns, rss, fds
+		status = 0
+		if (rss > rss1 * (100 + rss_margin) / 100) {
+			print run ": resident memory grew by more than " rss_margin "%"
+			status = 1
+		}
+		if (ns > ns1 * (100 + ns_margin) / 100) {
+			print run ": CPU time per event grew by more than " ns_margin "%"
+			status = 1
+		}
+		if (fds > fds1 + fd_margin) {
+			print run ": more than " fd_margin " more open files"
+			status = 1
+		}
+		exit status
+	}' "$1"
+}
+
+./arecordmidi --replay="$input" --replay-duration=${days}d -t 9600 \
+	--verify --seek-index --summary "$dir/month.mid" 2> "$dir/single.log" ||
+	{ cat "$dir/single.log"; exit 1; }
+./arecordmidi --replay="$input" --replay-duration=${days}d -t 9600 \
+	-T 600000 --verify "$dir/take-%Y-%m-%d-%H:%M:%S.mid" 2> "$dir/takes.log" ||
+	{ cat "$dir/takes.log"; exit 1; }
+
+status=0
+check_drift "$dir/single.log" "single take" || status=1
+check_drift "$dir/takes.log" "a take per pause" || status=1
+
+takes=0
+for take in "$dir"/*.mid
+do
+	./smfcheck "$take" > /dev/null || exit 1
+	takes=$((takes + 1))
+done
+echo "$takes files OK"
+exit $status
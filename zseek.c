@@ -0,0 +1,422 @@
+/*
+ * zseek.c - compressed takes in the zstd seekable format
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zstd.h>
+#include "zseek.h"
+
+#define INITIAL_FRAMES 4096	/* seek table entries allocated up front */
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int reserve(struct zseek_writer *w, size_t size)
+{
+	unsigned char *buf;
+
+	if (size <= w->buf_size)
+		return 0;
+	/* the trailer grows by a few bytes per frame */
+	if (size < w->buf_size * 2)
+		size = w->buf_size * 2;
+	buf = realloc(w->buf, size);
+	if (!buf)
+		return -ENOMEM;
+	w->buf = buf;
+	w->buf_size = size;
+	return 0;
+}
+
+static int add_frame(struct zseek_writer *w, uint32_t compressed,
+		     uint32_t decompressed)
+{
+	if (w->count == w->alloc) {
+		size_t alloc = w->alloc ? w->alloc * 2 : INITIAL_FRAMES;
+		struct zseek_frame *frames = realloc(w->frames,
+						     alloc * sizeof(*frames));
+
+		if (!frames)
+			return -ENOMEM;
+		w->frames = frames;
+		w->alloc = alloc;
+	}
+	w->frames[w->count].compressed = compressed;
+	w->frames[w->count].decompressed = decompressed;
+	w->count++;
+	return 0;
+}
+
+/*
+ * Builds the header of a frame that stores 'len' bytes as they are:
+ * magic, then a single-segment header with the smallest content size
+ * field.  Returns its size.
+ */
+static size_t stored_header(unsigned char *p, size_t len)
+{
+	put_le32(p, ZSEEK_FRAME_MAGIC);
+	if (len < 256) {
+		p[4] = 0x20;		/* single segment, 1-byte size */
+		p[5] = len;
+		return 6;
+	}
+	if (len < 65536 + 256) {
+		p[4] = 0x60;		/* 2-byte size, minus 256 */
+		p[5] = len - 256;
+		p[6] = (len - 256) >> 8;
+		return 7;
+	}
+	p[4] = 0xa0;			/* 4-byte size */
+	put_le32(p + 5, len);
+	return 9;
+}
+
+/* the header of a raw block */
+static void block_header(unsigned char *p, size_t len, int last)
+{
+	uint32_t block = last | len << 3;
+
+	p[0] = block;
+	p[1] = block >> 8;
+	p[2] = block >> 16;
+}
+
+/*
+ * Builds a frame that stores 'len' (< 256) bytes as they are in one raw
+ * block.  Returns the frame size; the data is at its end.
+ */
+static size_t stored_frame(unsigned char *p, const void *data, size_t len)
+{
+	size_t n = stored_header(p, len);
+
+	block_header(p + n, len, 1);
+	memcpy(p + n + 3, data, len);
+	return n + 3 + len;
+}
+
+static int write_at(struct zseek_writer *w, long offset, const void *data,
+		    size_t len)
+{
+	if (fseek(w->file, offset, SEEK_SET) ||
+	    fwrite(data, 1, len, w->file) != len)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Sets up a writer for blocks of up to 'block_size' bytes.  Everything
+ * writing them takes is allocated here: the buffer, the seek table for
+ * a long take, and the compression context, which zstd only allocates
+ * on its first use.
+ */
+int zseek_writer_init(struct zseek_writer *w, FILE *file, int level,
+		      size_t block_size)
+{
+	size_t table = 9 + 255 + 8 + (INITIAL_FRAMES + 1) * 8 + ZSEEK_FOOTER_SIZE;
+	size_t bound = ZSTD_compressBound(block_size);
+	void *zeros;
+	int err;
+
+	memset(w, 0, sizeof(*w));
+	w->file = file;
+	w->level = level;
+	w->data_end = w->file_end = ftell(file);
+	w->cctx = ZSTD_createCCtx();
+	w->frames = malloc(INITIAL_FRAMES * sizeof(*w->frames));
+	if (!w->cctx || !w->frames)
+		return -ENOMEM;
+	w->alloc = INITIAL_FRAMES;
+	err = reserve(w, bound > table ? bound : table);
+	if (err < 0)
+		return err;
+	zeros = calloc(1, block_size);
+	if (!zeros)
+		return -ENOMEM;
+	ZSTD_compressCCtx(w->cctx, w->buf, w->buf_size, zeros, block_size, level);
+	free(zeros);
+	return 0;
+}
+
+void zseek_writer_free(struct zseek_writer *w)
+{
+	ZSTD_freeCCtx(w->cctx);
+	free(w->frames);
+	free(w->buf);
+	memset(w, 0, sizeof(*w));
+}
+
+/*
+ * Appends a stored frame (len < 256).  Returns the file offset of the
+ * data, which can be overwritten in place later, or -errno.
+ */
+long zseek_write_stored(struct zseek_writer *w, const void *data, size_t len)
+{
+	size_t size;
+	long offset;
+	int err;
+
+	err = reserve(w, 9 + len);
+	if (err < 0)
+		return err;
+	size = stored_frame(w->buf, data, len);
+	err = write_at(w, w->data_end, w->buf, size);
+	if (err < 0)
+		return err;
+	err = add_frame(w, size, len);
+	if (err < 0)
+		return err;
+	offset = w->data_end + size - len;
+	w->data_end += size;
+	if (w->file_end < w->data_end)
+		w->file_end = w->data_end;
+	return offset;
+}
+
+/* appends a block of data as a compressed frame, over the old trailer */
+int zseek_write_block(struct zseek_writer *w, const void *data, size_t len)
+{
+	size_t size;
+	int err;
+
+	err = reserve(w, ZSTD_compressBound(len));
+	if (err < 0)
+		return err;
+	size = ZSTD_compressCCtx(w->cctx, w->buf, w->buf_size, data, len,
+				 w->level);
+	if (ZSTD_isError(size))
+		return -EIO;
+	err = write_at(w, w->data_end, w->buf, size);
+	if (err < 0)
+		return err;
+	/* so that a full disk shows here, before the frame is counted */
+	if (fflush(w->file))
+		return -errno;
+	err = add_frame(w, size, len);
+	if (err < 0)
+		return err;
+	w->data_end += size;
+	if (w->file_end < w->data_end)
+		w->file_end = w->data_end;
+	return 0;
+}
+
+/*
+ * (Re)writes the trailer: a stored frame with 'data' (len < 256), then
+ * the seek table covering all frames including that one.
+ */
+int zseek_write_trailer(struct zseek_writer *w, const void *data, size_t len)
+{
+	size_t table = (w->count + 1) * 8 + ZSEEK_FOOTER_SIZE;
+	size_t frame, size;
+	unsigned char *p;
+	int err;
+
+	err = reserve(w, 9 + len + 8 + table);
+	if (err < 0)
+		return err;
+	frame = stored_frame(w->buf, data, len);
+	p = w->buf + frame;
+	put_le32(p, ZSEEK_SKIPPABLE_MAGIC);
+	put_le32(p + 4, table);
+	p += 8;
+	for (size_t i = 0; i < w->count; i++, p += 8) {
+		put_le32(p, w->frames[i].compressed);
+		put_le32(p + 4, w->frames[i].decompressed);
+	}
+	put_le32(p, frame);
+	put_le32(p + 4, len);
+	p += 8;
+	put_le32(p, w->count + 1);
+	p[4] = 0;			/* no checksums */
+	put_le32(p + 5, ZSEEK_TABLE_MAGIC);
+	size = p + ZSEEK_FOOTER_SIZE - w->buf;
+
+	err = write_at(w, w->data_end, w->buf, size);
+	if (err < 0)
+		return err;
+	if (fflush(w->file))
+		return -errno;
+	/* a shorter end-of-track than last time leaves bytes behind */
+	if (w->data_end + (long)size < w->file_end &&
+	    ftruncate(fileno(w->file), w->data_end + size) < 0)
+		return -errno;
+	w->file_end = w->data_end + size;
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, data, len, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		data = (const char *)data + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/*
+ * Finishes the file after a fatal error: 'data' as a stored frame, then
+ * the trailer with 'end' (< 256 bytes).  Uses only pwrite() on 'fd', no
+ * stdio and no allocation, so that it can run in a signal handler.
+ * Returns 0 or -errno.
+ */
+int zseek_write_emergency(const struct zseek_writer *w, int fd,
+			  const void *data, size_t len,
+			  const void *end, size_t end_len)
+{
+	size_t count = w->count + (len ? 1 : 0) + 1;
+	unsigned char buf[512];
+	off_t offset = w->data_end;
+	uint32_t data_size = 0, end_size;
+	size_t n;
+	int err;
+
+	if (len) {
+		n = stored_header(buf, len);
+		err = pwrite_all(fd, buf, n, offset);
+		offset += n;
+		for (size_t done = 0; done < len && !err; ) {
+			size_t size = len - done < ZSEEK_BLOCK_MAX ?
+				len - done : ZSEEK_BLOCK_MAX;
+
+			block_header(buf, size, done + size == len);
+			err = pwrite_all(fd, buf, 3, offset);
+			if (!err)
+				err = pwrite_all(fd, (const char *)data + done, size,
+						 offset + 3);
+			offset += 3 + size;
+			done += size;
+		}
+		if (err < 0)
+			return err;
+		data_size = offset - w->data_end;
+	}
+	end_size = stored_frame(buf, end, end_len);
+	err = pwrite_all(fd, buf, end_size, offset);
+	if (err < 0)
+		return err;
+	offset += end_size;
+
+	put_le32(buf, ZSEEK_SKIPPABLE_MAGIC);
+	put_le32(buf + 4, count * 8 + ZSEEK_FOOTER_SIZE);
+	n = 8;
+	for (size_t i = 0; i <= count; i++) {
+		/* the entries, then the footer */
+		if (n + ZSEEK_FOOTER_SIZE > sizeof(buf)) {
+			err = pwrite_all(fd, buf, n, offset);
+			if (err < 0)
+				return err;
+			offset += n;
+			n = 0;
+		}
+		if (i < w->count) {
+			put_le32(buf + n, w->frames[i].compressed);
+			put_le32(buf + n + 4, w->frames[i].decompressed);
+		} else if (len && i == w->count) {
+			put_le32(buf + n, data_size);
+			put_le32(buf + n + 4, len);
+		} else if (i < count) {
+			put_le32(buf + n, end_size);
+			put_le32(buf + n + 4, end_len);
+		} else {
+			put_le32(buf + n, count);
+			buf[n + 4] = 0;		/* no checksums */
+			put_le32(buf + n + 5, ZSEEK_TABLE_MAGIC);
+			n += ZSEEK_FOOTER_SIZE;
+			break;
+		}
+		n += 8;
+	}
+	err = pwrite_all(fd, buf, n, offset);
+	if (err < 0)
+		return err;
+	if (ftruncate(fd, offset + n) < 0)
+		return -errno;
+	return 0;
+}
+
+int zseek_is_compressed(const unsigned char *p, size_t len)
+{
+	return len >= 4 && get_le32(p) == ZSEEK_FRAME_MAGIC;
+}
+
+/*
+ * Decompresses a whole file, using its seek table to find the frames.
+ * Returns a malloc()ed buffer, or NULL if the file is not valid.
+ */
+unsigned char *zseek_decompress(const unsigned char *p, size_t len,
+				size_t *out_len)
+{
+	const unsigned char *table, *footer;
+	unsigned char *out;
+	size_t count, entry, total = 0, pos = 0, offset = 0;
+
+	if (len < ZSEEK_FOOTER_SIZE + 8)
+		return NULL;
+	footer = p + len - ZSEEK_FOOTER_SIZE;
+	if (get_le32(footer + 5) != ZSEEK_TABLE_MAGIC)
+		return NULL;
+	count = get_le32(footer);
+	entry = footer[4] & 0x80 ? 12 : 8;
+	if (count > (len - ZSEEK_FOOTER_SIZE - 8) / entry)
+		return NULL;
+	table = footer - count * entry;
+	if (get_le32(table - 8) != ZSEEK_SKIPPABLE_MAGIC ||
+	    get_le32(table - 4) != count * entry + ZSEEK_FOOTER_SIZE)
+		return NULL;
+
+	for (size_t i = 0; i < count; i++) {
+		offset += get_le32(table + i * entry);
+		total += get_le32(table + i * entry + 4);
+	}
+	if (offset != (size_t)(table - 8 - p))
+		return NULL;
+	out = malloc(total ? total : 1);
+	if (!out)
+		return NULL;
+
+	offset = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t csize = get_le32(table + i * entry);
+		size_t dsize = get_le32(table + i * entry + 4);
+		size_t n = ZSTD_decompress(out + pos, dsize, p + offset, csize);
+
+		if (ZSTD_isError(n) || n != dsize) {
+			free(out);
+			return NULL;
+		}
+		offset += csize;
+		pos += dsize;
+	}
+	*out_len = total;
+	return out;
+}
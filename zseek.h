@@ -0,0 +1,60 @@
+/*
+ * zseek.h - compressed takes in the zstd seekable format
+ *
+ * A compressed take is a sequence of independent zstd frames, one per
+ * block of SMF data flushed by the recorder, followed by a seek table
+ * in a skippable frame, laid out as in the zstd "seekable format" so
+ * that both zstd -d and the zstd seekable library can read it.  The
+ * first frame holds the MThd chunk and the MTrk chunk header stored
+ * uncompressed, so the track length can still be patched in place.
+ * The trailer, a stored frame with the provisional end-of-track and
+ * then the seek table, is rewritten after every block: the file
+ * decompresses to a complete SMF at any time.
+ * All integers in the file are little-endian.
+ */
+
+#ifndef ZSEEK_H
+#define ZSEEK_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZSEEK_FRAME_MAGIC	0xfd2fb528
+#define ZSEEK_SKIPPABLE_MAGIC	0x184d2a5e
+#define ZSEEK_TABLE_MAGIC	0x8f92eab1
+#define ZSEEK_FOOTER_SIZE	9
+#define ZSEEK_BLOCK_MAX		(128 * 1024)
+
+struct zseek_frame {
+	uint32_t compressed;
+	uint32_t decompressed;
+};
+
+struct zseek_writer {
+	FILE *file;
+	void *cctx;
+	int level;
+	struct zseek_frame *frames;	/* written so far, without the trailer */
+	size_t count, alloc;
+	unsigned char *buf;		/* for a compressed frame or the trailer */
+	size_t buf_size;
+	long data_end;			/* file offset of the trailer */
+	long file_end;
+};
+
+int zseek_writer_init(struct zseek_writer *w, FILE *file, int level,
+		      size_t block_size);
+void zseek_writer_free(struct zseek_writer *w);
+long zseek_write_stored(struct zseek_writer *w, const void *data, size_t len);
+int zseek_write_block(struct zseek_writer *w, const void *data, size_t len);
+int zseek_write_trailer(struct zseek_writer *w, const void *data, size_t len);
+int zseek_write_emergency(const struct zseek_writer *w, int fd,
+			  const void *data, size_t len,
+			  const void *end, size_t end_len);
+
+int zseek_is_compressed(const unsigned char *p, size_t len);
+unsigned char *zseek_decompress(const unsigned char *p, size_t len,
+				size_t *out_len);
+
+#endif